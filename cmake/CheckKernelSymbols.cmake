@@ -0,0 +1,35 @@
+# Fails the link if a fat build's kernel tier defines a symbol outside its own
+# SIMD_TIER namespace. Any such symbol, like a std template instantiated by an
+# engine header, could be picked by the linker over the baseline copy and run
+# instructions the CPU doesn't have
+#
+# Usage: cmake -DNM=<nm> -DTIER=<tier> -DOBJECTS=<objects> -P CheckKernelSymbols.cmake
+
+execute_process(COMMAND ${NM} --defined-only --extern-only ${OBJECTS}
+        OUTPUT_VARIABLE SYMBOLS
+        RESULT_VARIABLE NM_RESULT)
+if (NOT NM_RESULT EQUAL 0)
+    message(FATAL_ERROR "Could not list the symbols of the ${TIER} kernels")
+endif ()
+
+# Mangled names spell each namespace as its length followed by its name
+string(LENGTH ${TIER} TIER_LENGTH)
+set(TIER_NAMESPACE "${TIER_LENGTH}${TIER}")
+
+string(REPLACE "\n" ";" SYMBOLS "${SYMBOLS}")
+set(LEAKED_SYMBOLS "")
+foreach (LINE IN LISTS SYMBOLS)
+    if (NOT LINE MATCHES "^[0-9a-fA-F]+ [A-Za-z] (.+)$")
+        continue()
+    endif ()
+    set(SYMBOL ${CMAKE_MATCH_1})
+    # The pointer to the C++ personality routine is the same in every object
+    if (NOT SYMBOL MATCHES "${TIER_NAMESPACE}" AND NOT SYMBOL MATCHES "^DW\\.ref\\.")
+        string(APPEND LEAKED_SYMBOLS "\n  ${SYMBOL}")
+    endif ()
+endforeach ()
+
+if (LEAKED_SYMBOLS)
+    message(FATAL_ERROR "The ${TIER} kernels define symbols outside their namespace, "
+            "keep engine and library code out of kernels.cc:${LEAKED_SYMBOLS}")
+endif ()
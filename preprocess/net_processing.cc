@@ -1,113 +1,165 @@
 #include <fstream>
+#include <string>
+#include <string_view>
 
-#include "../shared/nnue/definitions.h"
+#include "../shared/nnue/processing.h"
 #include <fmt/format.h>
+#include <fmt/ranges.h>
+
+struct Options {
+  std::string input_path;
+  std::string output_path;
+  // Process the network as the small one, see EVALFILE_SMALL
+  bool small = false;
+  // Activation statistics to order the neurons by, written by the engine's
+  // activations command
+  std::string stats_path;
+  // Write the network back in the trainer's format (with a header) instead of
+  // processing it, to publish a network whose neurons are already ordered
+  bool raw = false;
+};
+
+// Writes a network after its header, returning false on failure
+bool WriteNetwork(const std::string& path,
+                  const nnue::NetworkHeader& header,
+                  const void* network,
+                  std::size_t size) {
+  std::ofstream output_stream(path, std::ios::binary);
+  output_stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  output_stream.write(static_cast<const char*>(network), size);
+  return static_cast<bool>(output_stream);
+}
 
-std::unique_ptr<nnue::Network> ProcessNetwork(
-    const std::unique_ptr<nnue::RawNetwork>& raw_network) {
-  auto network = std::make_unique<nnue::Network>();
-
-  // Copy over arrays that don't need transposing
-  network->feature_weights = raw_network->feature_weights;
-  network->feature_biases = raw_network->feature_biases;
-
-#if BUILD_HAS_SIMD and !defined(SPARSE_PERMUTE)
-  constexpr int kWeightsPerBlock = sizeof(__m128i) / sizeof(int16_t);
-  constexpr int kNumRegs = sizeof(simd::Vepi16) / 8;
-  std::array<__m128i, kNumRegs> regs;
+template <typename Arch>
+int Preprocess(const Options& options) {
+  const auto& input_path = options.input_path;
+  const auto& output_path = options.output_path;
+  fmt::println("Preprocessing {} as a {}x{}x{} network",
+               input_path,
+               Arch::kL1Size,
+               Arch::kL2Size,
+               Arch::kL3Size);
 
-  auto weights = reinterpret_cast<__m128i*>(&network->feature_weights);
-  auto biases = reinterpret_cast<__m128i*>(&network->feature_biases);
+  auto raw_network = std::make_unique<nnue::RawNetwork<Arch>>();
 
-  for (int i = 0; i < nnue::arch::kInputBucketCount * 768 *
-                          nnue::arch::kL1Size / kWeightsPerBlock;
-       i += kNumRegs) {
-    for (int j = 0; j < kNumRegs; j++) regs[j] = weights[i + j];
+  // Raw networks may already carry a header, which must match the build
+  std::ifstream input_stream(input_path, std::ios::binary);
+  nnue::NetworkHeader header{};
+  input_stream.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (header.magic != nnue::NetworkHeader::kMagic) {
+    input_stream.clear();
+    input_stream.seekg(0);
+  } else if (header.version != nnue::NetworkHeader::kVersion ||
+             header.layout != nnue::NetworkHeader::kRawLayout ||
+             !header.HasArchitecture<Arch>()) {
+    fmt::println("Error: {} is not a raw network of this architecture",
+                 input_path);
+    return 1;
+  }
 
-    for (int j = 0; j < kNumRegs; j++)
-      weights[i + j] = regs[simd::kPackusOrder[j]];
+  input_stream.read(reinterpret_cast<char*>(raw_network.get()),
+                    sizeof(nnue::RawNetwork<Arch>));
+  if (!input_stream) {
+    fmt::println("Error: {} is smaller than a raw network ({} bytes)",
+                 input_path,
+                 sizeof(nnue::RawNetwork<Arch>));
+    return 1;
   }
 
-  for (int i = 0; i < nnue::arch::kL1Size / kWeightsPerBlock; i += kNumRegs) {
-    for (int j = 0; j < kNumRegs; j++) regs[j] = biases[i + j];
+  if (!options.stats_path.empty()) {
+    auto stats = std::make_unique<nnue::ActivationStats<Arch>>();
+    std::ifstream stats_stream(options.stats_path, std::ios::binary);
+    stats_stream.read(reinterpret_cast<char*>(stats.get()), sizeof(*stats));
+    if (!stats_stream || stats->magic != nnue::ActivationStats<Arch>::kMagic ||
+        stats->l1_size != Arch::kL1Size) {
+      fmt::println("Error: {} is not activation statistics of a {}-wide "
+                   "network",
+                   options.stats_path,
+                   Arch::kL1Size);
+      return 1;
+    }
 
-    for (int j = 0; j < kNumRegs; j++)
-      biases[i + j] = regs[simd::kPackusOrder[j]];
+    nnue::PermuteNeurons(*raw_network, *stats);
+    fmt::println("Ordered neurons by activation over {} positions",
+                 stats->position_count);
   }
-#endif
-
-  network->l1_biases = raw_network->l1_biases;
-  network->l2_biases = raw_network->l2_biases;
-  network->l3_weights = raw_network->l3_weights;
-  network->l3_biases = raw_network->l3_biases;
 
-  // Transpose l1_weights from [b][l2][l1] to [b][l1][l2]
-  for (int b = 0; b < nnue::arch::kOutputBucketCount; b++) {
-    for (int l1 = 0; l1 < nnue::arch::kL1Size; l1++) {
-      for (int l2 = 0; l2 < nnue::arch::kL2Size; l2++) {
-        network->l1_weights[b][l1][l2] = raw_network->l1_weights[b][l2][l1];
-      }
+  if (options.raw) {
+    if (!WriteNetwork(output_path,
+                      nnue::NetworkHeader::Make<Arch>(
+                          nnue::NetworkHeader::kRawLayout),
+                      raw_network.get(),
+                      sizeof(nnue::RawNetwork<Arch>))) {
+      fmt::println("Failed to write raw network");
+      return 1;
     }
+    fmt::println("Successfully wrote raw network to {}", output_path);
+    return 0;
   }
 
-#if BUILD_HAS_SIMD and !defined(SPARSE_PERMUTE)
-  // Weight permutation for DpbusdEpi32
-  {
-    const auto tmp = std::make_shared<nnue::Network>(*network);
-    for (int bucket = 0; bucket < nnue::arch::kOutputBucketCount; bucket++) {
-      for (int i = 0; i < nnue::arch::kL1Size; i += 4) {
-        for (int j = 0; j < nnue::arch::kL2Size; ++j) {
-          for (int k = 0; k < 4; k++) {
-            network
-                ->l1_weights_alt[bucket][i * nnue::arch::kL2Size + j * 4 + k] =
-                tmp->l1_weights[bucket][i + k][j];
-          }
-        }
+  const auto processed_network = std::make_unique<nnue::Network<Arch>>();
+  nnue::ProcessNetwork<Arch>(raw_network.get(), *processed_network);
+
+  // Weights outside the integer output tail's range are clipped, which only
+  // matters for builds that evaluate with it
+  int clipped_weights = 0;
+  for (int b = 0; b < Arch::kOutputBucketCount; b++) {
+    for (int l3 = 0; l3 < Arch::kL3Size; l3++) {
+      for (int l2 = 0; l2 < Arch::kL2Size; l2++) {
+        clipped_weights += std::abs(raw_network->l2_weights[b][l3][l2] *
+                                    nnue::arch::kL2WeightQuantization) > 127;
       }
     }
   }
+  fmt::println("Quantised output tail ({} of {} L2 weights clipped)",
+               clipped_weights,
+               Arch::kOutputBucketCount * Arch::kL3Size * Arch::kL2Size);
+
+#ifdef NNUE_I8_FEATURES
+  fmt::println("Quantised feature weights to int8 (bucket scales {})",
+               fmt::join(processed_network->feature_scales, " "));
 #endif
 
-  // Transpose l2_weights from [b][l3][l2] to [b][l2][l3]
-  for (int b = 0; b < nnue::arch::kOutputBucketCount; b++) {
-    for (int l2 = 0; l2 < nnue::arch::kL2Size; l2++) {
-      for (int l3 = 0; l3 < nnue::arch::kL3Size; l3++) {
-        network->l2_weights[b][l2][l3] = raw_network->l2_weights[b][l3][l2];
-      }
-    }
+  // The engine checks the header before using the embedded network
+  if (!WriteNetwork(output_path,
+                    nnue::NetworkHeader::Make<Arch>(nnue::kProcessedLayout),
+                    processed_network.get(),
+                    sizeof(nnue::Network<Arch>))) {
+    fmt::println("Failed to write processed network");
+    return 1;
   }
+  fmt::println("Successfully wrote processed network to {}", output_path);
 
-  return network;
+  return 0;
 }
 
 int main(int argc, char* argv[]) {
-  if (argc < 3) {
-    fmt::println("Usage: preprocess <input.nnue> <output.nnue>");
-    return 1;
+  Options options;
+  bool valid = argc >= 3;
+  for (int i = 3; valid && i < argc; i++) {
+    const std::string_view arg = argv[i];
+    if (arg == "--small") {
+      options.small = true;
+    } else if (arg == "--raw") {
+      options.raw = true;
+    } else if (arg == "--permute" && i + 1 < argc) {
+      options.stats_path = argv[++i];
+    } else {
+      valid = false;
+    }
   }
 
-  std::string input_path = argv[1];
-  std::string output_path = argv[2];
-
-  fmt::println("Preprocessing {}", input_path);
-
-  auto raw_network = std::make_unique<nnue::RawNetwork>();
-
-  std::ifstream input_stream(input_path, std::ios::binary);
-  input_stream.read(reinterpret_cast<char*>(raw_network.get()),
-                    sizeof(nnue::RawNetwork));
-
-  const auto processed_network = ProcessNetwork(raw_network);
-
-  std::ofstream output_stream(output_path, std::ios::binary | std::ios::ate);
-  output_stream.write(reinterpret_cast<char*>(processed_network.get()),
-                      sizeof(nnue::Network));
-
-  if (output_stream.bad()) {
-    fmt::println("Failed to write processed network");
-  } else {
-    fmt::println("Successfully wrote processed network to {}", output_path);
+  if (!valid) {
+    fmt::println(
+        "Usage: preprocess <input.nnue> <output.nnue> [--small] "
+        "[--permute <stats.bin>] [--raw]");
+    return 1;
   }
 
-  return 0;
-}
\ No newline at end of file
+  options.input_path = argv[1];
+  options.output_path = argv[2];
+  if (options.small) {
+    return Preprocess<nnue::SmallArch>(options);
+  }
+  return Preprocess<nnue::MainArch>(options);
+}
@@ -10,46 +10,195 @@ namespace nnue {
 
 namespace arch {
 
-constexpr std::size_t kL1Size = 1536;
-constexpr std::size_t kL2Size = 16;
-constexpr std::size_t kL3Size = 32;
-constexpr std::size_t kInputBucketCount = 12;
-constexpr std::size_t kOutputBucketCount = 8;
-
 constexpr std::int32_t kFtQuantization = 255;
 constexpr std::int32_t kL1Quantization = 128;
 
 constexpr std::int32_t kEvalScale = 200;
 
+// The integer output tail runs L2 and L3 on U8 activations in
+// [0, kTailActivationMax], where kTailActivationScale stands for 1.0. L1 sums
+// are shifted down into that range, and the L2 and L3 weights are quantised
+// by their own factors so that L2 sums shift back down into it as well
+constexpr std::int32_t kFtShift = 9;
+constexpr std::int32_t kTailL1Shift = 7;
+constexpr std::int32_t kTailL2Shift = 6;
+constexpr std::int32_t kTailActivationMax = 127;
+constexpr std::int32_t kL2WeightQuantization = 1 << kTailL2Shift;
+constexpr std::int32_t kL3WeightQuantization = 512;
+constexpr double kTailActivationScale =
+    static_cast<double>(kFtQuantization * kFtQuantization * kL1Quantization) /
+    (1 << (kFtShift + kTailL1Shift));
+
+// Input buckets by the square of the perspective's king, from its own side of
+// the board. Kings on the E-H files are mirrored onto the A-D files
+// clang-format off
+constexpr std::array<int, 64> kKingBucketMap {
+  0,  1,  2,  3,  3,  2,  1,  0,
+  4,  5,  6,  7,  7,  6,  5,  4,
+  8,  8,  9,  9,  9,  9,  8,  8,
+  10, 10, 10, 10, 10, 10, 10, 10,
+  10, 10, 10, 10, 10, 10, 10, 10,
+  11, 11, 11, 11, 11, 11, 11, 11,
+  11, 11, 11, 11, 11, 11, 11, 11,
+  11, 11, 11, 11, 11, 11, 11, 11,
+};
+// clang-format on
+
+// The shape of a network. Everything that depends on the layer sizes is
+// templated on one of these, so that networks of different sizes can be
+// evaluated by the same code
+template <std::size_t l1_size,
+          std::size_t l2_size,
+          std::size_t l3_size,
+          std::size_t output_bucket_count>
+struct Architecture {
+  static constexpr std::size_t kL1Size = l1_size;
+  static constexpr std::size_t kL2Size = l2_size;
+  static constexpr std::size_t kL3Size = l3_size;
+  static constexpr std::size_t kInputBucketCount = 12;
+  static constexpr std::size_t kOutputBucketCount = output_bucket_count;
+
+  // The SIMD kernels activate L1 in blocks of up to 128 neurons, and
+  // propagate L2 and L3 a whole register of sums at a time
+  static_assert(kL1Size % 128 == 0);
+  static_assert(kL2Size % 16 == 0 && kL3Size % 16 == 0);
+};
+
+// The network zekrom and its predecessors use
+using L1536 = Architecture<1536, 16, 32, 8>;
+// A narrower network that evaluates about three times as fast, for very short
+// time controls
+using L512 = Architecture<512, 16, 32, 8>;
+// A much smaller network, only good enough for lopsided positions
+using L256 = Architecture<256, 16, 32, 8>;
+
 }  // namespace arch
 
+// The architecture of the embedded network is chosen at compile time with
+// NNUE_L1_SIZE
+#if defined(NNUE_L1_SIZE) && NNUE_L1_SIZE == 512
+using MainArch = arch::L512;
+#else
+using MainArch = arch::L1536;
+#endif
+
+// The architecture of the optional small network embedded from EVALFILE_SMALL,
+// which clearly decided positions are evaluated with
+using SmallArch = arch::L256;
+
+// Feature transformer weights are stored as int8 with one scale per input
+// bucket in NNUE_I8_FEATURES builds, halving the bytes each accumulator update
+// streams, and are widened back to I16 as they are loaded
+#ifdef NNUE_I8_FEATURES
+using FeatureWeight = I8;
+#else
+using FeatureWeight = I16;
+#endif
+
+// How the layers after L1 are evaluated: in floats, or in integers with the
+// quantised copies of their weights
+enum class OutputTail {
+  kFloat,
+  kInteger
+};
+
 // clang-format off
+template <typename Arch>
 struct RawNetwork {
-  MultiArray<I16, arch::kInputBucketCount, 2, PieceType::kNumPieceTypes, Squares::kSquareCount, arch::kL1Size> feature_weights;
-  MultiArray<I16, arch::kL1Size> feature_biases;
-  MultiArray<I8, arch::kOutputBucketCount, arch::kL2Size, arch::kL1Size> l1_weights;
-  MultiArray<float, arch::kOutputBucketCount, arch::kL2Size> l1_biases;
-  MultiArray<float, arch::kOutputBucketCount, arch::kL3Size, arch::kL2Size> l2_weights;
-  MultiArray<float, arch::kOutputBucketCount, arch::kL3Size> l2_biases;
-  MultiArray<float, arch::kOutputBucketCount, arch::kL3Size> l3_weights;
-  MultiArray<float, arch::kOutputBucketCount> l3_biases;
+  MultiArray<I16, Arch::kInputBucketCount, 2, PieceType::kNumPieceTypes, Squares::kSquareCount, Arch::kL1Size> feature_weights;
+  MultiArray<I16, Arch::kL1Size> feature_biases;
+  MultiArray<I8, Arch::kOutputBucketCount, Arch::kL2Size, Arch::kL1Size> l1_weights;
+  MultiArray<float, Arch::kOutputBucketCount, Arch::kL2Size> l1_biases;
+  MultiArray<float, Arch::kOutputBucketCount, Arch::kL3Size, Arch::kL2Size> l2_weights;
+  MultiArray<float, Arch::kOutputBucketCount, Arch::kL3Size> l2_biases;
+  MultiArray<float, Arch::kOutputBucketCount, Arch::kL3Size> l3_weights;
+  MultiArray<float, Arch::kOutputBucketCount> l3_biases;
 };
 
+template <typename Arch>
 struct alignas(simd::kAlignment) Network {
-  alignas(simd::kAlignment) MultiArray<I16, arch::kInputBucketCount, 2, PieceType::kNumPieceTypes, Squares::kSquareCount, arch::kL1Size> feature_weights;
-  alignas(simd::kAlignment) MultiArray<I16, arch::kL1Size> feature_biases;
+  alignas(simd::kAlignment) MultiArray<FeatureWeight, Arch::kInputBucketCount, 2, PieceType::kNumPieceTypes, Squares::kSquareCount, Arch::kL1Size> feature_weights;
+  alignas(simd::kAlignment) MultiArray<I16, Arch::kInputBucketCount> feature_scales;
+  alignas(simd::kAlignment) MultiArray<I16, Arch::kL1Size> feature_biases;
   union {
-    alignas(simd::kAlignment) MultiArray<I8, arch::kOutputBucketCount, arch::kL1Size, arch::kL2Size> l1_weights;
-    alignas(simd::kAlignment) MultiArray<I8, arch::kOutputBucketCount, arch::kL1Size * arch::kL2Size> l1_weights_alt;
+    alignas(simd::kAlignment) MultiArray<I8, Arch::kOutputBucketCount, Arch::kL1Size, Arch::kL2Size> l1_weights;
+    alignas(simd::kAlignment) MultiArray<I8, Arch::kOutputBucketCount, Arch::kL1Size * Arch::kL2Size> l1_weights_alt;
   };
-  alignas(simd::kAlignment) MultiArray<float, arch::kOutputBucketCount, arch::kL2Size> l1_biases;
-  alignas(simd::kAlignment) MultiArray<float, arch::kOutputBucketCount, arch::kL2Size, arch::kL3Size> l2_weights;
-  alignas(simd::kAlignment) MultiArray<float, arch::kOutputBucketCount, arch::kL3Size> l2_biases;
-  alignas(simd::kAlignment) MultiArray<float, arch::kOutputBucketCount, arch::kL3Size> l3_weights;
-  alignas(simd::kAlignment) MultiArray<float, arch::kOutputBucketCount> l3_biases;
+  alignas(simd::kAlignment) MultiArray<float, Arch::kOutputBucketCount, Arch::kL2Size> l1_biases;
+  alignas(simd::kAlignment) MultiArray<float, Arch::kOutputBucketCount, Arch::kL2Size, Arch::kL3Size> l2_weights;
+  alignas(simd::kAlignment) MultiArray<float, Arch::kOutputBucketCount, Arch::kL3Size> l2_biases;
+  alignas(simd::kAlignment) MultiArray<float, Arch::kOutputBucketCount, Arch::kL3Size> l3_weights;
+  alignas(simd::kAlignment) MultiArray<float, Arch::kOutputBucketCount> l3_biases;
+  // Quantised copies of the layers after L1 for the integer output tail, with
+  // the L2 weights grouped in fours of inputs per output for DpbusdEpi32
+  alignas(simd::kAlignment) MultiArray<I32, Arch::kOutputBucketCount, Arch::kL2Size> l1_biases_int;
+  alignas(simd::kAlignment) MultiArray<I8, Arch::kOutputBucketCount, Arch::kL2Size / 4, Arch::kL3Size, 4> l2_weights_int;
+  alignas(simd::kAlignment) MultiArray<I32, Arch::kOutputBucketCount, Arch::kL3Size> l2_biases_int;
+  alignas(simd::kAlignment) MultiArray<I16, Arch::kOutputBucketCount, Arch::kL3Size> l3_weights_int;
+  alignas(simd::kAlignment) MultiArray<I32, Arch::kOutputBucketCount> l3_biases_int;
 };
 // clang-format on
 
+// Networks written by preprocess start with this header, so that loading one
+// of another architecture or layout fails instead of reading garbage. Raw
+// networks straight from the trainer have none. It fills a whole cache line
+// so that the network after it stays aligned
+struct alignas(64) NetworkHeader {
+  static constexpr U32 kMagic = 0x4C47544E;  // "NTGL"
+  static constexpr U32 kVersion = 1;
+  // Layout of a network in the trainer's format, see RawNetwork
+  static constexpr U32 kRawLayout = 0;
+
+  U32 magic;
+  U32 version;
+  // kRawLayout, or how the network was processed (see ProcessNetwork)
+  U32 layout;
+  U32 l1_size;
+  U32 l2_size;
+  U32 l3_size;
+  U32 input_bucket_count;
+  U32 output_bucket_count;
+  // Zero, kept for later versions
+  std::array<U32, 8> reserved;
+
+  template <typename Arch>
+  [[nodiscard]] static NetworkHeader Make(U32 layout) {
+    return {.magic = kMagic,
+            .version = kVersion,
+            .layout = layout,
+            .l1_size = Arch::kL1Size,
+            .l2_size = Arch::kL2Size,
+            .l3_size = Arch::kL3Size,
+            .input_bucket_count = Arch::kInputBucketCount,
+            .output_bucket_count = Arch::kOutputBucketCount,
+            .reserved = {}};
+  }
+
+  template <typename Arch>
+  [[nodiscard]] bool HasArchitecture() const {
+    return l1_size == Arch::kL1Size && l2_size == Arch::kL2Size &&
+           l3_size == Arch::kL3Size &&
+           input_bucket_count == Arch::kInputBucketCount &&
+           output_bucket_count == Arch::kOutputBucketCount;
+  }
+};
+
+static_assert(sizeof(NetworkHeader) == 64);
+
+// How often each pair of L1 neurons had a non-zero activation over a corpus of
+// positions, indexed in the raw network's order. The engine's activations
+// command writes these, and preprocess --permute orders the neurons by them
+template <typename Arch>
+struct ActivationStats {
+  static constexpr U32 kMagic = 0x5341544E;  // "NTAS"
+
+  U32 magic = kMagic;
+  U32 l1_size = Arch::kL1Size;
+  U64 position_count = 0;
+  // Counted from both perspectives of each position
+  std::array<U64, Arch::kL1Size / 2> counts{};
+};
+
 };  // namespace nnue
 
 #endif  // INTEGRAL_ARCH_H
\ No newline at end of file
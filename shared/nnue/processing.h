@@ -0,0 +1,255 @@
+#ifndef INTEGRAL_NNUE_PROCESSING_H
+#define INTEGRAL_NNUE_PROCESSING_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <numeric>
+
+#include "definitions.h"
+
+namespace nnue {
+
+// Reorders the L1 neurons of a raw network from the most to the least often
+// activated pair, so that the neurons the sparse L1 propagation skips are
+// mostly grouped together. The evaluation doesn't change
+template <typename Arch>
+void PermuteNeurons(RawNetwork<Arch>& network,
+                    const ActivationStats<Arch>& stats) {
+  constexpr int kPairCount = Arch::kL1Size / 2;
+
+  std::array<int, kPairCount> sorted_neurons;
+  std::iota(sorted_neurons.begin(), sorted_neurons.end(), 0);
+  std::ranges::stable_sort(sorted_neurons, [&](int a, int b) {
+    return stats.counts[a] > stats.counts[b];
+  });
+
+  const auto original = std::make_unique<RawNetwork<Arch>>(network);
+  for (int i = 0; i < kPairCount; i++) {
+    // Both neurons of a pair move together, as they're multiplied together
+    for (const int offset : {0, kPairCount}) {
+      const int to = i + offset;
+      const int from = sorted_neurons[i] + offset;
+
+      network.feature_biases[to] = original->feature_biases[from];
+      for (int b = 0; b < Arch::kInputBucketCount; b++) {
+        for (int side = 0; side < 2; side++) {
+          for (int piece = 0; piece < PieceType::kNumPieceTypes; piece++) {
+            for (int square = 0; square < Squares::kSquareCount; square++) {
+              network.feature_weights[b][side][piece][square][to] =
+                  original->feature_weights[b][side][piece][square][from];
+            }
+          }
+        }
+      }
+
+      for (int b = 0; b < Arch::kOutputBucketCount; b++) {
+        for (int l2 = 0; l2 < Arch::kL2Size; l2++) {
+          network.l1_weights[b][l2][to] = original->l1_weights[b][l2][from];
+        }
+      }
+    }
+  }
+}
+
+// The layout depends on the instruction set, see simd.h
+inline namespace SIMD_TIER {
+
+// Identifies the layout ProcessNetwork produces in this build, which depends
+// on the register width the feature weights are interleaved for, the feature
+// weight type and the alignment of the layers
+#if BUILD_HAS_SIMD
+constexpr U32 kProcessedLayout = 1 | sizeof(simd::Vepi16) << 8 |
+                                 sizeof(FeatureWeight) << 16 |
+                                 simd::kAlignment << 24;
+#else
+constexpr U32 kProcessedLayout =
+    1 | sizeof(FeatureWeight) << 16 | simd::kAlignment << 24;
+#endif
+
+// Where the L1 neuron that ProcessNetwork moves to the given index was in the
+// raw network. The feature transformer's outputs are interleaved to undo the
+// lane order of PackusEpi16
+[[nodiscard]] constexpr int RawNeuronIndex(int index) {
+#if BUILD_HAS_SIMD
+  constexpr int kWeightsPerBlock = sizeof(__m128i) / sizeof(int16_t);
+  constexpr int kNumRegs = sizeof(simd::Vepi16) / 8;
+  constexpr int kGroupSize = kWeightsPerBlock * kNumRegs;
+
+  const int group_start = index - index % kGroupSize;
+  const int block = index % kGroupSize / kWeightsPerBlock;
+  return group_start + simd::kPackusOrder[block] * kWeightsPerBlock +
+         index % kWeightsPerBlock;
+#else
+  return index;
+#endif
+}
+
+// Fills the integer copies of the layers after L1 that the integer output tail
+// evaluates with. Biases absorb half a step of the shift that follows them, so
+// that the shifts round to nearest instead of flooring
+template <typename Arch>
+void QuantiseOutputTail(const RawNetwork<Arch>* raw_network,
+                        Network<Arch>& network) {
+  constexpr double kScale = arch::kTailActivationScale;
+
+  const auto round_to = [](double value, double min, double max) {
+    return std::clamp(std::round(value), min, max);
+  };
+
+  for (int b = 0; b < Arch::kOutputBucketCount; b++) {
+    for (int l2 = 0; l2 < Arch::kL2Size; l2++) {
+      network.l1_biases_int[b][l2] = static_cast<I32>(
+          round_to(raw_network->l1_biases[b][l2] * kScale *
+                           (1 << arch::kTailL1Shift) +
+                       (1 << (arch::kTailL1Shift - 1)),
+                   INT32_MIN,
+                   INT32_MAX));
+    }
+
+    for (int l3 = 0; l3 < Arch::kL3Size; l3++) {
+      for (int l2 = 0; l2 < Arch::kL2Size; l2++) {
+        network.l2_weights_int[b][l2 / 4][l3][l2 % 4] = static_cast<I8>(
+            round_to(raw_network->l2_weights[b][l3][l2] *
+                         arch::kL2WeightQuantization,
+                     -127,
+                     127));
+      }
+
+      network.l2_biases_int[b][l3] = static_cast<I32>(
+          round_to(raw_network->l2_biases[b][l3] * kScale *
+                           arch::kL2WeightQuantization +
+                       (1 << (arch::kTailL2Shift - 1)),
+                   INT32_MIN,
+                   INT32_MAX));
+      network.l3_weights_int[b][l3] = static_cast<I16>(
+          round_to(raw_network->l3_weights[b][l3] *
+                       arch::kL3WeightQuantization,
+                   INT16_MIN,
+                   INT16_MAX));
+    }
+
+    network.l3_biases_int[b] = static_cast<I32>(
+        round_to(raw_network->l3_biases[b] * kScale *
+                     arch::kL3WeightQuantization,
+                 INT32_MIN,
+                 INT32_MAX));
+  }
+}
+
+// Stores the feature weights in the network's FeatureWeight type. Int8 weights
+// share one scale per input bucket, the smallest that fits the bucket's largest
+// weight, so that each stored weight times its scale approximates the original
+template <typename Arch>
+void QuantiseFeatureWeights(
+    const decltype(RawNetwork<Arch>::feature_weights)& feature_weights,
+    Network<Arch>& network) {
+  for (int b = 0; b < Arch::kInputBucketCount; b++) {
+#ifndef NNUE_I8_FEATURES
+    network.feature_weights[b] = feature_weights[b];
+    network.feature_scales[b] = 1;
+#else
+    const auto first = reinterpret_cast<const I16*>(&feature_weights[b]);
+    const auto last = first + sizeof(feature_weights[b]) / sizeof(I16);
+    const auto [min, max] = std::minmax_element(first, last);
+    const int max_abs =
+        std::max(-static_cast<int>(*min), static_cast<int>(*max));
+    const int scale = std::max(1, (max_abs + 126) / 127);
+    network.feature_scales[b] = static_cast<I16>(scale);
+
+    auto out = reinterpret_cast<FeatureWeight*>(&network.feature_weights[b]);
+    for (auto weight = first; weight != last; ++weight, ++out) {
+      *out = static_cast<FeatureWeight>(std::clamp<double>(
+          std::round(static_cast<double>(*weight) / scale), -127, 127));
+    }
+#endif
+  }
+}
+
+#if BUILD_HAS_SIMD
+// Reorders each group of blocks of eight values that a register covers, so
+// that the order PackusEpi16 interleaves the blocks in is undone
+template <typename T>
+void InterleaveForPackus(T* values, std::size_t count) {
+  constexpr int kValuesPerBlock = sizeof(__m128i) / sizeof(int16_t);
+  constexpr int kNumRegs = sizeof(simd::Vepi16) / 8;
+  constexpr int kGroupSize = kValuesPerBlock * kNumRegs;
+
+  T group[kGroupSize];
+  for (std::size_t i = 0; i < count; i += kGroupSize) {
+    std::memcpy(group, values + i, sizeof(group));
+    for (int j = 0; j < kNumRegs; j++) {
+      std::memcpy(values + i + j * kValuesPerBlock,
+                  group + simd::kPackusOrder[j] * kValuesPerBlock,
+                  kValuesPerBlock * sizeof(T));
+    }
+  }
+}
+#endif
+
+// Converts a network in the trainer's raw format into the layout the engine
+// evaluates with, filling in every layer of network. Shared by the preprocess
+// step and runtime network loading
+template <typename Arch>
+void ProcessNetwork(const RawNetwork<Arch>* raw_network,
+                    Network<Arch>& network) {
+  // The feature weights are quantised before being interleaved, which moves
+  // int8 weights the same way as full-width ones
+  QuantiseFeatureWeights<Arch>(raw_network->feature_weights, network);
+  network.feature_biases = raw_network->feature_biases;
+
+#if BUILD_HAS_SIMD
+  InterleaveForPackus(
+      reinterpret_cast<FeatureWeight*>(&network.feature_weights),
+      sizeof(network.feature_weights) / sizeof(FeatureWeight));
+  InterleaveForPackus(reinterpret_cast<I16*>(&network.feature_biases),
+                      Arch::kL1Size);
+#endif
+
+  network.l1_biases = raw_network->l1_biases;
+  network.l2_biases = raw_network->l2_biases;
+  network.l3_weights = raw_network->l3_weights;
+  network.l3_biases = raw_network->l3_biases;
+
+#if BUILD_HAS_SIMD
+  // Transpose l1_weights from [b][l2][l1] to [b][l1][l2], grouping each four
+  // inputs of an output together for DpbusdEpi32
+  for (int b = 0; b < Arch::kOutputBucketCount; b++) {
+    for (int l1 = 0; l1 < Arch::kL1Size; l1 += 4) {
+      for (int l2 = 0; l2 < Arch::kL2Size; l2++) {
+        for (int k = 0; k < 4; k++) {
+          network.l1_weights_alt[b][l1 * Arch::kL2Size + l2 * 4 + k] =
+              raw_network->l1_weights[b][l2][l1 + k];
+        }
+      }
+    }
+  }
+#else
+  // Transpose l1_weights from [b][l2][l1] to [b][l1][l2]
+  for (int b = 0; b < Arch::kOutputBucketCount; b++) {
+    for (int l1 = 0; l1 < Arch::kL1Size; l1++) {
+      for (int l2 = 0; l2 < Arch::kL2Size; l2++) {
+        network.l1_weights[b][l1][l2] = raw_network->l1_weights[b][l2][l1];
+      }
+    }
+  }
+#endif
+
+  // Transpose l2_weights from [b][l3][l2] to [b][l2][l3]
+  for (int b = 0; b < Arch::kOutputBucketCount; b++) {
+    for (int l2 = 0; l2 < Arch::kL2Size; l2++) {
+      for (int l3 = 0; l3 < Arch::kL3Size; l3++) {
+        network.l2_weights[b][l2][l3] = raw_network->l2_weights[b][l3][l2];
+      }
+    }
+  }
+
+  QuantiseOutputTail(raw_network, network);
+}
+
+}  // namespace SIMD_TIER
+
+}  // namespace nnue
+
+#endif  // INTEGRAL_NNUE_PROCESSING_H
@@ -4,12 +4,14 @@
 #include "../src/utils/types.h"
 
 #if defined(BUILD_NATIVE)
+#define SIMD_TIER native
 #if __BMI2__ && defined(BUILD_FAST_PEXT)
 #define BUILD_HAS_BMI2 1
 #else
 #define BUILD_HAS_BMI2 0
 #endif
 #define BUILD_HAS_AVX512VNNI __AVX512VNNI__
+#define BUILD_HAS_AVX512VBMI2 __AVX512VBMI2__
 #define BUILD_HAS_AVX512 (__AVX512F__ && (__AVX512BW__ || __AVX512VNNI__))
 #define BUILD_HAS_AVX2 __AVX2__
 #define BUILD_HAS_BMI1 __BMI__
@@ -18,8 +20,10 @@
 #define BUILD_HAS_NEON __ARM_NEON
 #define BUILD_HAS_SIMD (BUILD_HAS_AVX512 || BUILD_HAS_AVX2)
 #elif defined(BUILD_VNNI512)
+#define SIMD_TIER vnni512
 #define BUILD_HAS_BMI2 1
 #define BUILD_HAS_AVX512VNNI 1
+#define BUILD_HAS_AVX512VBMI2 1
 #define BUILD_HAS_AVX512 1
 #define BUILD_HAS_AVX2 1
 #define BUILD_HAS_BMI1 1
@@ -28,8 +32,10 @@
 #define BUILD_HAS_NEON 0
 #define BUILD_HAS_SIMD 1
 #elif defined(BUILD_AVX512)
+#define SIMD_TIER avx512
 #define BUILD_HAS_BMI2 1
 #define BUILD_HAS_AVX512VNNI 0
+#define BUILD_HAS_AVX512VBMI2 0
 #define BUILD_HAS_AVX512 1
 #define BUILD_HAS_AVX2 1
 #define BUILD_HAS_BMI1 1
@@ -38,8 +44,10 @@
 #define BUILD_HAS_NEON 0
 #define BUILD_HAS_SIMD 1
 #elif defined(BUILD_AVX2_BMI2)
+#define SIMD_TIER avx2_bmi2
 #define BUILD_HAS_BMI2 1
 #define BUILD_HAS_AVX512VNNI 0
+#define BUILD_HAS_AVX512VBMI2 0
 #define BUILD_HAS_AVX512 0
 #define BUILD_HAS_AVX2 1
 #define BUILD_HAS_BMI1 1
@@ -48,8 +56,10 @@
 #define BUILD_HAS_NEON 0
 #define BUILD_HAS_SIMD 1
 #elif defined(BUILD_AVX2)
+#define SIMD_TIER avx2
 #define BUILD_HAS_BMI2 0
 #define BUILD_HAS_AVX512VNNI 0
+#define BUILD_HAS_AVX512VBMI2 0
 #define BUILD_HAS_AVX512 0
 #define BUILD_HAS_AVX2 1
 #define BUILD_HAS_BMI1 1
@@ -58,8 +68,10 @@
 #define BUILD_HAS_NEON 0
 #define BUILD_HAS_SIMD 1
 #elif defined(BUILD_SSE41_POPCNT)
+#define SIMD_TIER sse41
 #define BUILD_HAS_BMI2 0
 #define BUILD_HAS_AVX512VNNI 0
+#define BUILD_HAS_AVX512VBMI2 0
 #define BUILD_HAS_AVX512 0
 #define BUILD_HAS_AVX2 0
 #define BUILD_HAS_BMI1 0
@@ -74,7 +86,11 @@
 #include <immintrin.h>
 #endif
 
+// Everything compiled for a specific instruction set lives in an inline
+// namespace named after it, so that fat builds (BUILD_FAT) can link a copy of
+// the NNUE kernels per tier without their inline functions colliding
 namespace simd {
+inline namespace SIMD_TIER {
 
 #if BUILD_HAS_AVX512
 
@@ -116,6 +132,11 @@ inline Vepi16 LoadEpi16(const int16_t* memory_address) {
   return _mm512_load_si512(reinterpret_cast<const __m512i*>(memory_address));
 }
 
+inline Vepi16 LoadEpi8AsEpi16(const int8_t* memory_address) {
+  return _mm512_cvtepi8_epi16(
+      _mm256_load_si256(reinterpret_cast<const __m256i*>(memory_address)));
+}
+
 inline Vepi32 LoadEpi32(const int32_t* memory_address) {
   return _mm512_load_si512(reinterpret_cast<const __m512i*>(memory_address));
 }
@@ -135,6 +156,10 @@ inline Vepi16 AddEpi16(Vepi32 v1, Vepi32 v2) {
   return _mm512_add_epi16(v1, v2);
 }
 
+inline Vepi16 SubEpi16(Vepi16 v1, Vepi16 v2) {
+  return _mm512_sub_epi16(v1, v2);
+}
+
 inline Vepi32 AddEpi32(Vepi32 v1, Vepi32 v2) {
   return _mm512_add_epi32(v1, v2);
 }
@@ -227,7 +252,12 @@ using Vepi32 = __m256i;
 using Vepf32 = __m256;
 
 constexpr int kPackusOrder[4] = {0, 2, 1, 3};
+#ifdef BUILD_FAT
+// Structures are shared between every tier of a fat build
+constexpr int kAlignment = 64;
+#else
 constexpr int kAlignment = std::max<int>(8, sizeof(Vepi16));
+#endif
 
 inline Vepi32 DpbusdEpi32(Vepi32 sum, Vepi8 first, Vepi8 second) {
   Vepi32 sum32 = _mm256_madd_epi16(_mm256_maddubs_epi16(first, second),
@@ -255,6 +285,11 @@ inline Vepi16 LoadEpi16(const int16_t* memory_address) {
   return _mm256_load_si256(reinterpret_cast<const __m256i*>(memory_address));
 }
 
+inline Vepi16 LoadEpi8AsEpi16(const int8_t* memory_address) {
+  return _mm256_cvtepi8_epi16(
+      _mm_load_si128(reinterpret_cast<const __m128i*>(memory_address)));
+}
+
 inline Vepi32 LoadEpi32(const int32_t* memory_address) {
   return _mm256_load_si256(reinterpret_cast<const __m256i*>(memory_address));
 }
@@ -271,6 +306,10 @@ inline Vepi16 AddEpi16(Vepi32 v1, Vepi32 v2) {
   return _mm256_add_epi16(v1, v2);
 }
 
+inline Vepi16 SubEpi16(Vepi16 v1, Vepi16 v2) {
+  return _mm256_sub_epi16(v1, v2);
+}
+
 inline Vepi32 AddEpi32(Vepi32 v1, Vepi32 v2) {
   return _mm256_add_epi32(v1, v2);
 }
@@ -406,6 +445,7 @@ inline float ReduceAddPsRecursive(float* sums, int length) {
   return ReduceAddPsRecursive(sums, length);
 }
 
+}  // namespace SIMD_TIER
 }  // namespace simd
 
 #endif  // INTEGRAL_SIMD_H_
\ No newline at end of file
@@ -37,10 +37,23 @@ Board &Board::operator=(const Board &other) {
   return *this;
 }
 
+void Board::SetPositionKeepingAccumulator(const Board &other) {
+  state_ = other.state_;
+  history_ = other.history_;
+
+  if (!accumulator_) {
+    accumulator_ = std::make_shared<nnue::Accumulator>();
+  }
+  accumulator_->SetRoot(state_);
+}
+
 void Board::SetFromFen(std::string_view fen_str) {
   state_ = fen::StringToBoard(fen_str);
 
-  accumulator_ = std::make_shared<nnue::Accumulator>();
+  // The accumulator is refreshed from scratch, so its stack can be reused
+  if (!accumulator_) {
+    accumulator_ = std::make_shared<nnue::Accumulator>();
+  }
   accumulator_->SetFromState(state_);
 
   history_.Clear();
@@ -288,6 +288,11 @@ class Board {
   // Copy assignment operator for deep copy of the accumulator
   Board &operator=(const Board &other);
 
+  // Copies another board's position and history, keeping this board's own
+  // accumulator stack and Finny tables and moving their root to the new
+  // position instead of refreshing a fresh stack from zero
+  void SetPositionKeepingAccumulator(const Board &other);
+
   inline auto &GetState() {
     return state_;
   }
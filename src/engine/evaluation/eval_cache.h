@@ -1,53 +1,137 @@
 #ifndef INTEGRAL_EVAL_CACHE_H_
 #define INTEGRAL_EVAL_CACHE_H_
 
+#include <array>
+#include <atomic>
+
+#include "../../utils/hash_table.h"
 #include "../../utils/types.h"
-#include <cstring>
 
 namespace eval {
 
-// Simple evaluation cache to avoid recomputing NNUE evaluations
-class EvalCache {
+// The number of entries in each bucket of the evaluation cache is chosen at
+// compile time with EVAL_CACHE_WAYS
+#if defined(EVAL_CACHE_WAYS) && EVAL_CACHE_WAYS == 2
+constexpr int kEvalCacheWays = 2;
+#else
+constexpr int kEvalCacheWays = 4;
+#endif
+
+// The size of each search thread's cache unless set with EvalCacheMB
+constexpr std::size_t kDefaultEvalCacheMbSize = 1;
+
+// Counters of how often evaluations are found in the cache, only gathered in
+// builds with EVAL_CACHE_STATS enabled. Each search thread owns one, padded to
+// whole cache lines so that threads sharing a cache never share a line of
+// counters
+struct alignas(64) EvalCacheStats {
+  U64 probes = 0;
+  U64 hits = 0;
+
+  EvalCacheStats &operator+=(const EvalCacheStats &other) {
+    probes += other.probes;
+    hits += other.hits;
+    return *this;
+  }
+};
+
+#ifdef EVAL_CACHE_STATS
+constexpr bool kTrackEvalCacheStats = true;
+#else
+constexpr bool kTrackEvalCacheStats = false;
+#endif
+
+// Set-associative cache of evaluations, either private to a search thread or
+// shared by all of them. Each entry packs the low 32 bits of the position's
+// key, the generation it was stored in and its score into one atomic word, so
+// that threads sharing the cache never see half-written entries. Buckets keep
+// their most recently inserted entry first and replace the oldest one
+struct alignas(kEvalCacheWays * sizeof(U64)) EvalCacheBucket {
+  std::array<std::atomic<U64>, kEvalCacheWays> entries;
+};
+
+class EvalCache : public AlignedHashTable<EvalCacheBucket> {
  public:
-  struct Entry {
-    U64 key;
-    Score score;
-  };
-  
-  static constexpr size_t kCacheSize = 1 << 16;  // 64K entries
-  static constexpr size_t kCacheMask = kCacheSize - 1;
-  
-  EvalCache() {
-    Clear();
+  EvalCache() = default;
+
+  [[nodiscard]] bool Probe(U64 key, Score &score) {
+    const auto &bucket = (*this)[key];
+    // The bucket is indexed by the high bits of the key
+    const U64 tag = Tag(key);
+    for (const auto &entry : bucket.entries) {
+      const U64 value = entry.load(std::memory_order_relaxed);
+      if ((value & ~kScoreMask) == tag) {
+        score = static_cast<I16>(value & kScoreMask);
+        return true;
+      }
+    }
+    return false;
   }
-  
-  void Clear() {
-    std::memset(entries_, 0, sizeof(entries_));
+
+  void Store(U64 key, Score score) {
+    // Scores are packed like the static evals of TT entries, and the rare
+    // evaluation that doesn't fit is simply not cached
+    if (score != static_cast<I16>(score)) {
+      return;
+    }
+
+    auto &bucket = (*this)[key];
+    const U64 tag = Tag(key);
+    const U64 value = tag | static_cast<U16>(score);
+    // A position already in the bucket is overwritten in place, so that it
+    // never occupies two ways and threads sharing the cache only write one
+    // entry instead of the whole bucket
+    for (auto &entry : bucket.entries) {
+      if ((entry.load(std::memory_order_relaxed) & ~kScoreMask) == tag) {
+        entry.store(value, std::memory_order_relaxed);
+        return;
+      }
+    }
+
+    for (int i = kEvalCacheWays - 1; i > 0; i--) {
+      bucket.entries[i].store(
+          bucket.entries[i - 1].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+    }
+    bucket.entries[0].store(value, std::memory_order_relaxed);
   }
-  
-  [[nodiscard]] inline bool Probe(U64 key, Score& score) const {
-    const size_t index = key & kCacheMask;
-    const Entry& entry = entries_[index];
-    
-    if (entry.key == key) {
-      score = entry.score;
-      return true;
+
+  // Logically empties the cache in O(1), since entries stored in an earlier
+  // generation never match again
+  void NewGeneration() {
+    // Zeroed entries are never mistaken for ones of the current generation
+    if (++generation_ == 0) {
+      generation_ = 1;
     }
-    return false;
   }
-  
-  inline void Store(U64 key, Score score) {
-    const size_t index = key & kCacheMask;
-    Entry& entry = entries_[index];
-    
-    entry.key = key;
-    entry.score = score;
+
+  void Clear() {
+    for (std::size_t i = 0; i < table_size_; i++) {
+      for (auto &entry : table_[i].entries) {
+        entry.store(0, std::memory_order_relaxed);
+      }
+    }
+    generation_ = 1;
   }
-  
+
  private:
-  alignas(64) Entry entries_[kCacheSize];
+  static constexpr U64 kScoreMask = 0xFFFF;
+
+  // The low 32 bits of the key above the generation, leaving the low 16 bits
+  // for the score
+  [[nodiscard]] U64 Tag(U64 key) const {
+    return static_cast<U64>(static_cast<U32>(key)) << 32 |
+           static_cast<U64>(generation_) << 16;
+  }
+
+  U16 generation_ = 1;
 };
 
+// The cache and counters of the search thread running on this OS thread, set
+// whenever a search starts. Evaluations outside of a search aren't cached
+inline thread_local EvalCache *eval_cache = nullptr;
+inline thread_local EvalCacheStats *eval_cache_stats = nullptr;
+
 }  // namespace eval
 
-#endif  // INTEGRAL_EVAL_CACHE_H_
\ No newline at end of file
+#endif  // INTEGRAL_EVAL_CACHE_H_
@@ -7,27 +7,68 @@ namespace eval {
 
 TUNABLE_STEP(kMaterialScaleBase, 26909, 10000, 32768, false, 500);
 
-// Thread-local evaluation cache for each thread
-thread_local EvalCache eval_cache;
+#ifdef EVALFILE_SMALL
+TUNABLE_STEP(kSmallNetThreshold, 500, 200, 1200, false, 25);
+TUNABLE_STEP(kSmallNetFallbackMargin, 250, 0, 800, false, 25);
+#endif
+
+namespace {
 
-void ClearEvalCache() {
-  eval_cache.Clear();
+#ifdef EVALFILE_SMALL
+// The material balance from the side to move's point of view
+Score MaterialBalance(const BoardState &state) {
+  const BitBoard &us = state.Occupied(state.turn);
+  const BitBoard &them = state.Occupied(FlipColor(state.turn));
+
+  Score balance = 0;
+  for (int piece = kPawn; piece <= kQueen; ++piece) {
+    const BitBoard &pieces = state.piece_bbs[piece];
+    balance += *kSeePieceScores[piece] *
+               ((pieces & us).PopCount() - (pieces & them).PopCount());
+  }
+  return balance;
 }
+#endif
+
+Score EvaluateNetwork(Board &board) {
+#ifdef EVALFILE_SMALL
+  // Positions that are clearly decided on material are left to the small
+  // network, unless it finds the game closer than the material suggests
+  if (std::abs(MaterialBalance(board.GetState())) > kSmallNetThreshold) {
+    const Score small_eval = nnue::EvaluateSmall(board);
+    if (std::abs(small_eval) >= kSmallNetFallbackMargin) {
+      return small_eval;
+    }
+  }
+#endif
+  return nnue::Evaluate(board);
+}
+
+}  // namespace
 
 Score Evaluate(Board &board) {
   const auto &state = board.GetState();
   const U64 key = state.zobrist_key;
   
   // Check cache first
-  Score cached_score;
-  if (eval_cache.Probe(key, cached_score)) {
-    return cached_score;
+  const auto cache = eval_cache;
+  if (cache) {
+    if constexpr (kTrackEvalCacheStats) {
+      ++eval_cache_stats->probes;
+    }
+    Score cached_score;
+    if (cache->Probe(key, cached_score)) {
+      if constexpr (kTrackEvalCacheStats) {
+        ++eval_cache_stats->hits;
+      }
+      return cached_score;
+    }
   }
   
-  const auto network_eval = nnue::Evaluate(board);
+  const auto network_eval = EvaluateNetwork(board);
 
 #if DATAGEN
-  eval_cache.Store(key, network_eval);
+  if (cache) cache->Store(key, network_eval);
   return network_eval;
 #endif
 
@@ -40,7 +81,7 @@ Score Evaluate(Board &board) {
   const Score final_eval = network_eval * (kMaterialScaleBase + material_phase) / 32768;
   
   // Store in cache
-  eval_cache.Store(key, final_eval);
+  if (cache) cache->Store(key, final_eval);
   
   return final_eval;
 }
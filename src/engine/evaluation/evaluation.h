@@ -61,8 +61,6 @@ bool StaticExchange(Move move, int threshold, const BoardState &state);
 
 Score Evaluate(Board &board);
 
-void ClearEvalCache();
-
 }  // namespace eval
 
 #endif  // INTEGRAL_EVAL_H_
\ No newline at end of file
@@ -5,26 +5,11 @@
 #include "../../../../shared/simd.h"
 #include "../../../chess/board.h"
 #include "../../../utils/fused.h"
+#include "kernels.h"
 #include "nnue.h"
 
 namespace nnue {
 
-constexpr U8 kBucketDivisor =
-    (32 + arch::kOutputBucketCount - 1) / arch::kOutputBucketCount;
-
-// clang-format off
-constexpr std::array<int, 64> kKingBucketMap {
-  0,  1,  2,  3,  3,  2,  1,  0,
-  4,  5,  6,  7,  7,  6,  5,  4,
-  8,  8,  9,  9,  9,  9,  8,  8,
-  10, 10, 10, 10, 10, 10, 10, 10,
-  10, 10, 10, 10, 10, 10, 10, 10,
-  11, 11, 11, 11, 11, 11, 11, 11,
-  11, 11, 11, 11, 11, 11, 11, 11,
-  11, 11, 11, 11, 11, 11, 11, 11,
-};
-// clang-format on
-
 struct FeatureData {
   Square square = Squares::kNoSquare;
   PieceType piece = PieceType::kNone;
@@ -41,33 +26,46 @@ struct AccumulatorChange {
   } type;
 };
 
-static std::array<I16, arch::kL1Size>& GetFeatureTable(Square square,
-                                                       Square king_square,
-                                                       PieceType piece,
-                                                       Color piece_color,
-                                                       Color perspective) {
+template <typename Arch>
+std::array<FeatureWeight, Arch::kL1Size>& GetFeatureTable(
+    Square square,
+    Square king_square,
+    PieceType piece,
+    Color piece_color,
+    Color perspective) {
   if (king_square.File() >= kFileE) {
     square = square ^ 0b111;
   }
 
   const int relative_king_square = king_square ^ (56 * perspective);
-  const int king_bucket_idx = kKingBucketMap[relative_king_square];
+  const int king_bucket_idx = arch::kKingBucketMap[relative_king_square];
   const int square_idx = square ^ 56 * perspective;
   const int color_idx = perspective != piece_color;
   const int piece_idx = piece;
 
-  return network
+  return GetNetwork<Arch>()
       ->feature_weights[king_bucket_idx][color_idx][piece_idx][square_idx]
       .as_array();
 }
 
+// Returns what the feature weights of the king's input bucket are multiplied by
+// when widened to I16, which is always 1 unless they are stored as int8
+template <typename Arch>
+I16 GetFeatureScale(Square king_square, Color perspective) {
+  const int king_bucket_idx =
+      arch::kKingBucketMap[king_square ^ (56 * perspective)];
+  return GetNetwork<Arch>()->feature_scales[king_bucket_idx];
+}
+
+template <typename Arch>
 class PerspectiveAccumulator {
  public:
   PerspectiveAccumulator() : values_({}) {}
 
   void Reset() {
     // Initialize the accumulator values with the network biases
-    for (int i = 0; i < arch::kL1Size; ++i) {
+    const auto network = GetNetwork<Arch>();
+    for (int i = 0; i < Arch::kL1Size; ++i) {
       values_[i] = network->feature_biases[i];
     }
   }
@@ -86,12 +84,13 @@ class PerspectiveAccumulator {
     }
   }
 
-  I16 const* GetFeaturePointer(Square square,
-                               Square king_square,
-                               PieceType piece,
-                               Color piece_color,
-                               Color perspective) {
-    return GetFeatureTable(square, king_square, piece, piece_color, perspective)
+  FeatureWeight const* GetFeaturePointer(Square square,
+                                         Square king_square,
+                                         PieceType piece,
+                                         Color piece_color,
+                                         Color perspective) {
+    return GetFeatureTable<Arch>(
+               square, king_square, piece, piece_color, perspective)
         .data();
   }
 
@@ -114,23 +113,46 @@ class PerspectiveAccumulator {
                    Color perspective,
                    Square king_square,
                    const Ts&... accumulator_changes) {
-    auto FeatureTable = [&](const FeatureData& feature) {
-      return GetFeaturePointer(feature.square,
-                               king_square,
-                               feature.piece,
-                               feature.color,
-                               perspective);
+    std::array<FeatureWeight const*, sizeof...(ops)> adds, subs;
+    int num_adds = 0, num_subs = 0;
+    const auto push_row = [&](FusedOperation op, const FeatureData& feature) {
+      const auto row = GetFeaturePointer(feature.square,
+                                         king_square,
+                                         feature.piece,
+                                         feature.color,
+                                         perspective);
+      if (op == kAdd) {
+        adds[num_adds++] = row;
+      } else {
+        subs[num_subs++] = row;
+      }
     };
+    (push_row(ops, accumulator_changes), ...);
+
+    ApplyRows(previous,
+              adds.data(),
+              num_adds,
+              subs.data(),
+              num_subs,
+              GetFeatureScale<Arch>(king_square, perspective));
+  }
 
-    const std::tuple changes = {FeatureTable(accumulator_changes)...};
-
-    for (int i = 0; i < arch::kL1Size; ++i) {
-      values_[i] = std::apply(
-          [&](const auto&... changes) {
-            return Fused<ops...>(previous[i], changes[i]...);
-          },
-          changes);
-    }
+  // Applies any number of add and sub rows on top of the previous accumulator,
+  // one register tile at a time, so that each chunk is loaded and stored once.
+  // All rows must belong to the input bucket that feature_scale is taken from
+  void ApplyRows(const PerspectiveAccumulator& previous,
+                 FeatureWeight const* const* adds,
+                 int num_adds,
+                 FeatureWeight const* const* subs,
+                 int num_subs,
+                 I16 feature_scale) {
+    kernels::ApplyRows<Arch>(values_.data(),
+                             previous.values_.data(),
+                             adds,
+                             num_adds,
+                             subs,
+                             num_subs,
+                             feature_scale);
   }
 
   void ApplyChange(const PerspectiveAccumulator& previous,
@@ -170,20 +192,43 @@ class PerspectiveAccumulator {
     return values_[idx];
   }
 
+  [[nodiscard]] const I16* Data() const {
+    return values_.data();
+  }
+
  private:
-  alignas(simd::kAlignment) std::array<I16, arch::kL1Size> values_;
+  alignas(simd::kAlignment) std::array<I16, Arch::kL1Size> values_;
 };
 
+// The eight bitboards of a position that the Finny table refresh diffs
+// against, so that pushing a move doesn't copy the whole board state
+struct AccumulatorBoard {
+  AccumulatorBoard() = default;
+
+  AccumulatorBoard(const BoardState& state)
+      : piece_bbs(state.piece_bbs), side_bbs(state.side_bbs) {}
+
+  [[nodiscard]] constexpr BitBoard King(Color side) const {
+    return piece_bbs[PieceType::kKing] & side_bbs[side];
+  }
+
+  std::array<BitBoard, kNumPieceTypes> piece_bbs;
+  std::array<BitBoard, 2> side_bbs;
+};
+
+template <typename Arch>
 struct AccumulatorEntry {
-  alignas(simd::kAlignment) std::array<PerspectiveAccumulator, 2> perspectives;
+  alignas(simd::kAlignment)
+      std::array<PerspectiveAccumulator<Arch>, 2> perspectives;
   AccumulatorChange change;
   std::array<Square, 2> kings;
   std::array<bool, 2> updated;
-  BoardState state;
+  AccumulatorBoard board;
 };
 
+template <typename Arch>
 struct BucketCacheEntry {
-  AccumulatorEntry accumulator;
+  AccumulatorEntry<Arch> accumulator;
   MultiArray<BitBoard, 2, kNumPieceTypes> piece_bbs{};
   MultiArray<BitBoard, 2, kNumColors> side_bbs{};
 
@@ -199,24 +244,72 @@ struct BucketCacheEntry {
   }
 };
 
-class Accumulator {
+// The stack of accumulators of one network, from the root of the search to the
+// current position, along with its Finny table
+template <typename Arch>
+class AccumulatorStack {
  public:
-  Accumulator() : head_idx_(0) {
+  AccumulatorStack() : head_idx_(0) {
     stack_.resize(512);
   }
 
-  void SetFromState(const BoardState& state) {
+  // Refreshes the accumulators from scratch, or only from the differences to
+  // the last position refreshed in each king bucket if reset_cache is false
+  void SetFromState(const BoardState& state, bool reset_cache = true) {
+    // Cached buckets hold sums of the old weights after a network swap
+    if (network_version_ != network_version) {
+      for (auto& mirrored_cache : input_bucket_cache_) {
+        for (auto& entry : mirrored_cache) entry.Reset();
+      }
+      network_version_ = network_version;
+    }
+
     head_idx_ = 0;
+    stack_[head_idx_].board = state;
     for (const Color color : {Color::kBlack, Color::kWhite}) {
       auto& accumulator = stack_[head_idx_];
-      RefreshPerspective(accumulator, state, color, true);
+      RefreshPerspective(accumulator, accumulator.board, color, reset_cache);
       accumulator.updated[color] = true;
       accumulator.kings[color] = state.King(color).GetLsb();
     }
+    has_root_ = true;
   }
 
-  void RefreshPerspective(AccumulatorEntry& __restrict__ accumulator,
-                          const BoardState& __restrict__ state,
+  // Moves the root to a new position, usually the previous root a move or two
+  // further into the game. Perspectives whose king stays in the same bucket
+  // only apply the pieces that differ from the previous root, while the others
+  // refresh from the Finny table
+  void SetRoot(const BoardState& state) {
+    if (!has_root_ || network_version_ != network_version) {
+      SetFromState(state);
+      return;
+    }
+
+    head_idx_ = 0;
+    auto& root = stack_[head_idx_];
+    const AccumulatorBoard board = state;
+    for (const Color color : {Color::kBlack, Color::kWhite}) {
+      const Square king_square = state.King(color).GetLsb();
+      if (NeedRefresh(color, root.kings[color], king_square)) {
+        RefreshPerspective(root, board, color);
+      } else {
+        auto& perspective_accumulator = root.perspectives[color];
+        ApplyPieceDifferences(perspective_accumulator,
+                              perspective_accumulator,
+                              root.board.piece_bbs,
+                              root.board.side_bbs,
+                              board,
+                              king_square,
+                              color);
+      }
+      root.updated[color] = true;
+      root.kings[color] = king_square;
+    }
+    root.board = board;
+  }
+
+  void RefreshPerspective(AccumulatorEntry<Arch>& __restrict__ accumulator,
+                          const AccumulatorBoard& __restrict__ state,
                           Color perspective,
                           bool reset = false) {
     const auto king_square = Square(state.King(perspective).GetLsb());
@@ -232,23 +325,48 @@ class Accumulator {
     // Instead of refreshing this perspective's accumulator from zero pieces, we
     // reset from the pieces of the last accumulator update in this bucket. This
     // is an optimization trick known as "Finny Tables".
-    std::array<I16 const*, 32> adds;
-    int num_adds = 0;
-    std::array<I16 const*, 32> subs;
-    int num_subs = 0;
     auto& perspective_accumulator =
         cached.accumulator.perspectives[perspective];
+    ApplyPieceDifferences(perspective_accumulator,
+                          perspective_accumulator,
+                          cached.piece_bbs[perspective],
+                          cached.side_bbs[perspective],
+                          state,
+                          king_square,
+                          perspective);
+
+    cached.side_bbs[perspective] = state.side_bbs;
+    cached.piece_bbs[perspective] = state.piece_bbs;
+
+    accumulator.perspectives[perspective] =
+        cached.accumulator.perspectives[perspective];
+  }
+
+  // Stores in accumulator the previous accumulator of a position with the
+  // given pieces, updated to the pieces of state. The king must stay in the
+  // same bucket, so that every feature maps to the same weights
+  template <typename PieceBitBoards, typename SideBitBoards>
+  void ApplyPieceDifferences(PerspectiveAccumulator<Arch>& accumulator,
+                             const PerspectiveAccumulator<Arch>& previous,
+                             const PieceBitBoards& old_piece_bbs,
+                             const SideBitBoards& old_side_bbs,
+                             const AccumulatorBoard& state,
+                             Square king_square,
+                             Color perspective) {
+    std::array<FeatureWeight const*, 32> adds;
+    int num_adds = 0;
+    std::array<FeatureWeight const*, 32> subs;
+    int num_subs = 0;
     for (const Color color : {Color::kBlack, Color::kWhite}) {
       for (int piece = PieceType::kPawn; piece <= PieceType::kKing; piece++) {
-        const BitBoard old_pieces = cached.piece_bbs[perspective][piece] &
-                                    cached.side_bbs[perspective][color];
+        const BitBoard old_pieces = old_piece_bbs[piece] & old_side_bbs[color];
         const BitBoard new_pieces =
             state.piece_bbs[piece] & state.side_bbs[color];
 
         // Calculate difference of features to remove
         const BitBoard to_remove = ~new_pieces & old_pieces;
         for (Square square : to_remove) {
-          subs[num_subs++] = perspective_accumulator.GetFeaturePointer(
+          subs[num_subs++] = accumulator.GetFeaturePointer(
               square,
               king_square,
               static_cast<PieceType>(piece),
@@ -259,7 +377,7 @@ class Accumulator {
         // Calculate difference of features to add
         const BitBoard to_add = new_pieces & ~old_pieces;
         for (Square square : to_add) {
-          adds[num_adds++] = perspective_accumulator.GetFeaturePointer(
+          adds[num_adds++] = accumulator.GetFeaturePointer(
               square,
               king_square,
               static_cast<PieceType>(piece),
@@ -269,39 +387,12 @@ class Accumulator {
       }
     }
 
-    // Perform all add operations
-    for (; num_adds >= 4; num_adds -= 4) {
-      for (int i = 0; i < arch::kL1Size; ++i) {
-        perspective_accumulator[i] +=
-            adds[num_adds - 4][i] + adds[num_adds - 3][i] +
-            adds[num_adds - 2][i] + adds[num_adds - 1][i];
-      }
-    }
-    for (; num_adds >= 1; num_adds -= 1) {
-      for (int i = 0; i < arch::kL1Size; ++i) {
-        perspective_accumulator[i] += adds[num_adds - 1][i];
-      }
-    }
-
-    // Perform all sub operations
-    for (; num_subs >= 4; num_subs -= 4) {
-      for (int i = 0; i < arch::kL1Size; ++i) {
-        perspective_accumulator[i] -=
-            subs[num_subs - 4][i] + subs[num_subs - 3][i] +
-            subs[num_subs - 2][i] + subs[num_subs - 1][i];
-      }
-    }
-    for (; num_subs >= 1; num_subs -= 1) {
-      for (int i = 0; i < arch::kL1Size; ++i) {
-        perspective_accumulator[i] -= subs[num_subs - 1][i];
-      }
-    }
-
-    cached.side_bbs[perspective] = state.side_bbs;
-    cached.piece_bbs[perspective] = state.piece_bbs;
-
-    accumulator.perspectives[perspective] =
-        cached.accumulator.perspectives[perspective];
+    accumulator.ApplyRows(previous,
+                          adds.data(),
+                          num_adds,
+                          subs.data(),
+                          num_subs,
+                          GetFeatureScale<Arch>(king_square, perspective));
   }
 
   void PushChanges(const BoardState& state, AccumulatorChange& change) {
@@ -311,7 +402,7 @@ class Accumulator {
     entry.change = change;
     entry.updated[Color::kBlack] = false;
     entry.updated[Color::kWhite] = false;
-    entry.state = state;
+    entry.board = state;
 
     // Update king positions if necessary
     if (change.sub_0.piece == PieceType::kKing) {
@@ -332,38 +423,39 @@ class Accumulator {
         continue;
       }
 
-      int iter = head_idx_;
-      while (true) {
-        --iter;
-
-        // We've found the earliest updated accumulator
-        if (stack_[iter].updated[perspective]) {
-          int last_updated = iter;
-
-          // Apply all updates from the earliest updated accumulator to now
-          while (last_updated != head_idx_) {
-            auto& dirty_accumulator = stack_[last_updated + 1];
-            const auto& clean_accumulator = stack_[last_updated];
-
-            // If the accumulator needs a refresh, we skip applying updates and
-            // just refresh it
-            if (NeedRefresh(perspective,
-                            clean_accumulator.kings[perspective],
-                            dirty_accumulator.kings[perspective])) {
-              RefreshPerspective(
-                  dirty_accumulator, dirty_accumulator.state, perspective);
-            } else {
-              dirty_accumulator.perspectives[perspective].ApplyChange(
-                  clean_accumulator.perspectives[perspective],
-                  dirty_accumulator.change,
-                  perspective,
-                  dirty_accumulator.kings[perspective]);
-            }
-            // Mark the accumulator as having been updated
-            stack_[++last_updated].updated[perspective] = true;
-          }
-          break;
+      // Find the latest accumulator that is up to date for this perspective
+      int last_updated = head_idx_ - 1;
+      while (!stack_[last_updated].updated[perspective]) {
+        --last_updated;
+      }
+
+      // Bring the accumulator up to date, fusing up to kMaxFusedPlies pending
+      // moves at a time so that the plies in between are never materialized
+      while (last_updated != head_idx_) {
+        const int target =
+            std::min(head_idx_, last_updated + kMaxFusedPlies);
+        auto& dirty_accumulator = stack_[target];
+        const auto& clean_accumulator = stack_[last_updated];
+
+        // If the accumulator needs a refresh, we skip applying updates and
+        // just refresh it
+        if (NeedRefresh(perspective,
+                        clean_accumulator.kings[perspective],
+                        dirty_accumulator.kings[perspective])) {
+          RefreshPerspective(
+              dirty_accumulator, dirty_accumulator.board, perspective);
+        } else if (target == last_updated + 1) {
+          dirty_accumulator.perspectives[perspective].ApplyChange(
+              clean_accumulator.perspectives[perspective],
+              dirty_accumulator.change,
+              perspective,
+              dirty_accumulator.kings[perspective]);
+        } else {
+          ApplyFusedChanges(last_updated, target, perspective);
         }
+        // Mark the accumulator as having been updated
+        dirty_accumulator.updated[perspective] = true;
+        last_updated = target;
       }
     }
   }
@@ -394,28 +486,177 @@ class Accumulator {
 
   [[nodiscard]] int GetOutputBucket(const BoardState& state) const {
     return std::min((state.Occupied().PopCount() - 2) / kBucketDivisor,
-                    static_cast<int>(arch::kOutputBucketCount - 1));
+                    static_cast<int>(Arch::kOutputBucketCount - 1));
   }
 
-  [[nodiscard]] PerspectiveAccumulator& operator[](int perspective) {
+  [[nodiscard]] PerspectiveAccumulator<Arch>& operator[](int perspective) {
     return stack_[head_idx_].perspectives[perspective];
   }
 
-  [[nodiscard]] const PerspectiveAccumulator& operator[](
+  [[nodiscard]] const PerspectiveAccumulator<Arch>& operator[](
       int perspective) const {
     return stack_[head_idx_].perspectives[perspective];
   }
 
  private:
+  // Applies the changes of every ply in (from, to] to the accumulator at
+  // `from` in a single pass and stores the result at `to`. The king bucket of
+  // `to` must match that of `from`, so every feature maps to the same weights.
+  void ApplyFusedChanges(int from, int to, Color perspective) {
+    std::array<FeatureWeight const*, kMaxFusedPlies * 2> adds;
+    int num_adds = 0;
+    std::array<FeatureWeight const*, kMaxFusedPlies * 2> subs;
+    int num_subs = 0;
+
+    auto& target = stack_[to];
+    const Square king_square = target.kings[perspective];
+
+    // Adds a feature row to one list unless it cancels a row in the other,
+    // e.g. a piece that moves away and later returns to the same square
+    const auto push_row = [](FeatureWeight const* row, auto& list, int& size,
+                             auto& opposite, int& opposite_size) {
+      for (int i = 0; i < opposite_size; i++) {
+        if (opposite[i] == row) {
+          opposite[i] = opposite[--opposite_size];
+          return;
+        }
+      }
+      list[size++] = row;
+    };
+    const auto add = [&](const FeatureData& feature) {
+      push_row(GetFeatureTable<Arch>(feature.square,
+                                     king_square,
+                                     feature.piece,
+                                     feature.color,
+                                     perspective)
+                   .data(),
+               adds,
+               num_adds,
+               subs,
+               num_subs);
+    };
+    const auto sub = [&](const FeatureData& feature) {
+      push_row(GetFeatureTable<Arch>(feature.square,
+                                     king_square,
+                                     feature.piece,
+                                     feature.color,
+                                     perspective)
+                   .data(),
+               subs,
+               num_subs,
+               adds,
+               num_adds);
+    };
+
+    for (int ply = from + 1; ply <= to; ply++) {
+      const auto& change = stack_[ply].change;
+      add(change.add_0);
+      sub(change.sub_0);
+      switch (change.type) {
+        case AccumulatorChange::kNormal:
+          break;
+        case AccumulatorChange::kCapture:
+          sub(change.sub_1);
+          break;
+        case AccumulatorChange::kCastle:
+          add(change.add_1);
+          sub(change.sub_1);
+          break;
+      }
+    }
+
+    target.perspectives[perspective].ApplyRows(
+        stack_[from].perspectives[perspective],
+        adds.data(),
+        num_adds,
+        subs.data(),
+        num_subs,
+        GetFeatureScale<Arch>(king_square, perspective));
+  }
+
   [[nodiscard]] inline int GetKingBucket(Square king_square,
                                          Color king_color) const {
-    return kKingBucketMap[king_square ^ (56 * king_color)];
+    return arch::kKingBucketMap[king_square ^ (56 * king_color)];
   }
 
  private:
+  // Upper bound on the pending plies folded into one accumulator update
+  static constexpr int kMaxFusedPlies = 8;
+
+  static constexpr U8 kBucketDivisor =
+      (32 + Arch::kOutputBucketCount - 1) / Arch::kOutputBucketCount;
+
   int head_idx_;
-  std::vector<AccumulatorEntry> stack_;
-  MultiArray<BucketCacheEntry, 2, arch::kInputBucketCount> input_bucket_cache_;
+  std::vector<AccumulatorEntry<Arch>> stack_;
+  MultiArray<BucketCacheEntry<Arch>, 2, Arch::kInputBucketCount>
+      input_bucket_cache_;
+  U32 network_version_ = network_version;
+  // Whether the root entry holds the accumulators of some position, which the
+  // next root can be updated from
+  bool has_root_ = false;
+};
+
+// Evaluates the position at the top of the stack from the side to move's point
+// of view, bringing its accumulators up to date first
+template <typename Arch>
+Score Evaluate(AccumulatorStack<Arch>& accumulator,
+               const BoardState& state,
+               OutputTail tail = kDefaultOutputTail) {
+  accumulator.ApplyChanges();
+  return kernels::Forward<Arch>(*GetNetwork<Arch>(),
+                                accumulator[state.turn].Data(),
+                                accumulator[FlipColor(state.turn)].Data(),
+                                accumulator.GetOutputBucket(state),
+                                tail);
+}
+
+// The accumulators of the networks the engine evaluates with. Each network has
+// its own stack, which is only brought up to date when that network evaluates
+class Accumulator {
+ public:
+  void SetFromState(const BoardState& state, bool reset_cache = true) {
+    main_.SetFromState(state, reset_cache);
+#ifdef EVALFILE_SMALL
+    small_.SetFromState(state, reset_cache);
+#endif
+  }
+
+  void SetRoot(const BoardState& state) {
+    main_.SetRoot(state);
+#ifdef EVALFILE_SMALL
+    small_.SetRoot(state);
+#endif
+  }
+
+  void PushChanges(const BoardState& state, AccumulatorChange& change) {
+    main_.PushChanges(state, change);
+#ifdef EVALFILE_SMALL
+    small_.PushChanges(state, change);
+#endif
+  }
+
+  void UndoMove() {
+    main_.UndoMove();
+#ifdef EVALFILE_SMALL
+    small_.UndoMove();
+#endif
+  }
+
+  [[nodiscard]] AccumulatorStack<MainArch>& Main() {
+    return main_;
+  }
+
+#ifdef EVALFILE_SMALL
+  [[nodiscard]] AccumulatorStack<SmallArch>& Small() {
+    return small_;
+  }
+#endif
+
+ private:
+  AccumulatorStack<MainArch> main_;
+#ifdef EVALFILE_SMALL
+  AccumulatorStack<SmallArch> small_;
+#endif
 };
 
 }  // namespace nnue
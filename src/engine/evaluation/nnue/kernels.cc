@@ -0,0 +1,752 @@
+#include "kernels.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#include "../../../../shared/nnue/processing.h"
+#include "sparse.h"
+
+// This file is compiled once per instruction set tier in fat builds, so
+// everything in it must stay inside the tier's namespace
+
+#define KERNELS_STRINGIFY_IMPL(x) #x
+#define KERNELS_STRINGIFY(x) KERNELS_STRINGIFY_IMPL(x)
+
+namespace nnue::kernels::SIMD_TIER {
+
+namespace {
+
+[[nodiscard]] I32 CReLU(I16 value) {
+  return std::clamp<I32>(value, 0, arch::kFtQuantization);
+}
+
+[[nodiscard]] float CReLU(float value) {
+  return std::clamp(value, 0.0f, 1.0f);
+}
+
+constexpr float kTailOutputScale =
+    arch::kEvalScale /
+    (arch::kTailActivationScale * arch::kL3WeightQuantization);
+
+// Activates the L1 sums for the integer tail
+template <typename Arch>
+void ActivateTailL1(const Network<Arch> &network,
+                    int bucket,
+                    const std::array<I32, Arch::kL2Size> &sums,
+                    std::array<U8, Arch::kL2Size> &l1_output) {
+  for (int i = 0; i < Arch::kL2Size; i++) {
+    l1_output[i] = static_cast<U8>(std::clamp<I32>(
+        (sums[i] + network.l1_biases_int[bucket][i]) >> arch::kTailL1Shift,
+        0,
+        arch::kTailActivationMax));
+  }
+}
+
+[[nodiscard]] I32 ActivateTailL2(I32 sum) {
+  return std::clamp<I32>(
+      sum >> arch::kTailL2Shift, 0, arch::kTailActivationMax);
+}
+
+// Runs L2 and L3 in integers on the L1 sums. Every activation fits in 7 bits,
+// so DpbusdEpi32's 16-bit intermediate sums can never saturate
+template <typename Arch>
+Score EvaluateIntegerTail(const Network<Arch> &network,
+                          const std::array<I32, Arch::kL2Size> &l1_sums,
+                          int bucket) {
+  // The L1 sums were written through vector references, so they are copied
+  // out before being read as scalars
+  std::array<I32, Arch::kL2Size> sums;
+  std::memcpy(sums.data(), l1_sums.data(), sizeof(sums));
+
+  alignas(simd::kAlignment) std::array<U8, Arch::kL2Size> l1_output;
+  ActivateTailL1<Arch>(network, bucket, sums, l1_output);
+
+  alignas(simd::kAlignment) std::array<I32, Arch::kL3Size> l2_sums;
+  std::memcpy(l2_sums.data(),
+              network.l2_biases_int[bucket].data(),
+              sizeof(l2_sums));
+
+#if BUILD_HAS_SIMD
+  constexpr int kI32ChunkSize = sizeof(simd::Vepi32) / sizeof(I32);
+
+  // Broadcast each group of four activations to every 32-bit lane. They are
+  // copied rather than cast, as they were just written as U8s
+  simd::Vepi32 input_vectors[Arch::kL2Size / 4];
+  for (int i = 0; i < Arch::kL2Size; i += 4) {
+    I32 inputs;
+    std::memcpy(&inputs, &l1_output[i], sizeof(inputs));
+    input_vectors[i / 4] = simd::SetEpi32(inputs);
+  }
+
+  // The sums are read back as scalars below, so they go through explicit
+  // loads and stores instead of vector-typed references
+  for (int j = 0; j < Arch::kL3Size; j += kI32ChunkSize) {
+    auto sums = simd::LoadEpi32(&l2_sums[j]);
+    for (int i = 0; i < Arch::kL2Size / 4; i++) {
+      const auto weight_vector = *reinterpret_cast<const simd::Vepi8 *>(
+          &network.l2_weights_int[bucket][i][j]);
+      sums = simd::DpbusdEpi32(sums, input_vectors[i], weight_vector);
+    }
+    simd::StoreEpi32(&l2_sums[j], sums);
+  }
+#else
+  for (int i = 0; i < Arch::kL2Size; i++) {
+    if (!l1_output[i]) continue;
+
+    for (int j = 0; j < Arch::kL3Size; j++) {
+      l2_sums[j] +=
+          l1_output[i] * network.l2_weights_int[bucket][i / 4][j][i % 4];
+    }
+  }
+#endif
+
+  I32 l3_sum = network.l3_biases_int[bucket];
+  for (int i = 0; i < Arch::kL3Size; i++) {
+    l3_sum += ActivateTailL2(l2_sums[i]) * network.l3_weights_int[bucket][i];
+  }
+
+  // Scale output
+  return static_cast<Score>(static_cast<float>(l3_sum) * kTailOutputScale);
+}
+
+// Runs L2 and L3 in integers on the L1 sums of a batch of positions, loading
+// each block of weights once for all of them
+template <typename Arch>
+void EvaluateIntegerTailBatch(
+    const Network<Arch> &network,
+    const std::array<std::array<I32, Arch::kL2Size>, kMaxBatchSize> &l1_sums,
+    int count,
+    int bucket,
+    Score *scores) {
+  alignas(simd::kAlignment)
+      std::array<std::array<U8, Arch::kL2Size>, kMaxBatchSize> l1_output;
+  alignas(simd::kAlignment)
+      std::array<std::array<I32, Arch::kL3Size>, kMaxBatchSize> l2_sums;
+  for (int p = 0; p < count; p++) {
+    ActivateTailL1<Arch>(network, bucket, l1_sums[p], l1_output[p]);
+    std::memcpy(l2_sums[p].data(),
+                network.l2_biases_int[bucket].data(),
+                sizeof(l2_sums[p]));
+  }
+
+#if BUILD_HAS_SIMD
+  constexpr int kI32ChunkSize = sizeof(simd::Vepi32) / sizeof(I32);
+  constexpr int kL2Registers = Arch::kL3Size / kI32ChunkSize;
+
+  // Each group of four activations has its own block of L2 weights
+  for (int i = 0; i < Arch::kL2Size; i += 4) {
+    simd::Vepi8 weights[kL2Registers];
+    for (int r = 0; r < kL2Registers; r++) {
+      weights[r] = *reinterpret_cast<const simd::Vepi8 *>(
+          &network.l2_weights_int[bucket][i / 4][r * kI32ChunkSize]);
+    }
+
+    for (int p = 0; p < count; p++) {
+      I32 inputs;
+      std::memcpy(&inputs, &l1_output[p][i], sizeof(inputs));
+      const auto input_vector = simd::SetEpi32(inputs);
+      for (int r = 0; r < kL2Registers; r++) {
+        I32 *sums = &l2_sums[p][r * kI32ChunkSize];
+        simd::StoreEpi32(
+            sums,
+            simd::DpbusdEpi32(simd::LoadEpi32(sums), input_vector, weights[r]));
+      }
+    }
+  }
+#else
+  for (int i = 0; i < Arch::kL2Size; i++) {
+    const auto &weights = network.l2_weights_int[bucket][i / 4];
+    for (int p = 0; p < count; p++) {
+      if (!l1_output[p][i]) continue;
+
+      for (int j = 0; j < Arch::kL3Size; j++) {
+        l2_sums[p][j] += l1_output[p][i] * weights[j][i % 4];
+      }
+    }
+  }
+#endif
+
+  std::array<I32, kMaxBatchSize> l3_sums;
+  std::fill_n(l3_sums.begin(), count, network.l3_biases_int[bucket]);
+  for (int i = 0; i < Arch::kL3Size; i++) {
+    const I32 weight = network.l3_weights_int[bucket][i];
+    for (int p = 0; p < count; p++) {
+      l3_sums[p] += ActivateTailL2(l2_sums[p][i]) * weight;
+    }
+  }
+
+  for (int p = 0; p < count; p++) {
+    scores[p] =
+        static_cast<Score>(static_cast<float>(l3_sums[p]) * kTailOutputScale);
+  }
+}
+
+#if BUILD_HAS_SIMD
+// Both x86-64 AVX2 and AVX-512 have 16 vector registers to spare for a tile
+constexpr int kMaxTileRegisters = 16;
+constexpr int kChunkSize = sizeof(simd::Vepi16) / sizeof(I16);
+constexpr int kRegistersPerLine =
+    std::max<int>(1, 64 / (kChunkSize * sizeof(FeatureWeight)));
+
+// Loads a register of feature weights as I16, widening int8 weights and
+// multiplying them by their bucket's scale
+inline simd::Vepi16 LoadWeights(FeatureWeight const *row,
+                                [[maybe_unused]] simd::Vepi16 scale) {
+#ifdef NNUE_I8_FEATURES
+  return simd::MultiplyEpi16(simd::LoadEpi8AsEpi16(row), scale);
+#else
+  return simd::LoadEpi16(row);
+#endif
+}
+
+// Converts the L1 sums to floats and activates them
+template <typename Arch>
+void ActivateL1(const Network<Arch> &network,
+                int bucket,
+                std::array<I32, Arch::kL2Size> &l1_sums,
+                std::array<float, Arch::kL2Size> &l1_output) {
+  constexpr int kF32ChunkSize = sizeof(simd::Vepi16) / sizeof(float);
+
+  // Quantisation constants to convert to float
+  constexpr float kL1Normalization =
+      static_cast<float>(1 << arch::kFtShift) /
+      static_cast<float>(arch::kFtQuantization * arch::kFtQuantization *
+                         arch::kL1Quantization);
+  const auto l1_multiplier_vector = simd::SetPs(kL1Normalization);
+  const auto zero_float_vector = simd::ZeroPs(),
+             one_float_vector = simd::SetPs(1.0f);
+
+  for (int i = 0; i < Arch::kL2Size; i += kF32ChunkSize) {
+    const auto bias_vector = *reinterpret_cast<const simd::Vepf32 *>(
+        &network.l1_biases[bucket][i]);
+    const auto float_vector =
+        simd::ConvertEpi32ToPs(*reinterpret_cast<simd::Vepi32 *>(&l1_sums[i]));
+    const auto casted_sum =
+        simd::MultiplyAddPs(float_vector, l1_multiplier_vector, bias_vector);
+    auto &features = *reinterpret_cast<simd::Vepf32 *>(&l1_output[i]);
+    features = simd::MinPs(simd::MaxPs(casted_sum, zero_float_vector),
+                           one_float_vector);
+  }
+}
+#endif
+
+}  // namespace
+
+template <typename Arch>
+void ApplyRows(I16 *values,
+               const I16 *previous,
+               FeatureWeight const *const *adds,
+               int num_adds,
+               FeatureWeight const *const *subs,
+               int num_subs,
+               I16 feature_scale) {
+#if BUILD_HAS_SIMD
+  // Narrow networks are covered by fewer registers
+  constexpr int kTileRegisters =
+      std::min<int>(kMaxTileRegisters, Arch::kL1Size / kChunkSize);
+  constexpr int kTileSize = kChunkSize * kTileRegisters;
+  static_assert(Arch::kL1Size % kTileSize == 0);
+
+  const auto scale = simd::SetEpi16(feature_scale);
+
+  // Start fetching the same rows for the next tile while this one is being
+  // worked on
+  const auto prefetch_next_tile = [](const FeatureWeight *row) {
+    for (int r = 0; r < kTileRegisters; r += kRegistersPerLine) {
+      __builtin_prefetch(row + kTileSize + r * kChunkSize);
+    }
+  };
+
+  for (int tile = 0; tile < Arch::kL1Size; tile += kTileSize) {
+    const bool has_next_tile = tile + kTileSize < Arch::kL1Size;
+
+    simd::Vepi16 registers[kTileRegisters];
+    for (int r = 0; r < kTileRegisters; r++) {
+      registers[r] = simd::LoadEpi16(&previous[tile + r * kChunkSize]);
+    }
+
+    for (int i = 0; i < num_adds; i++) {
+      const FeatureWeight *row = adds[i] + tile;
+      if (has_next_tile) prefetch_next_tile(row);
+      for (int r = 0; r < kTileRegisters; r++) {
+        registers[r] = simd::AddEpi16(registers[r],
+                                      LoadWeights(row + r * kChunkSize, scale));
+      }
+    }
+
+    for (int i = 0; i < num_subs; i++) {
+      const FeatureWeight *row = subs[i] + tile;
+      if (has_next_tile) prefetch_next_tile(row);
+      for (int r = 0; r < kTileRegisters; r++) {
+        registers[r] = simd::SubEpi16(registers[r],
+                                      LoadWeights(row + r * kChunkSize, scale));
+      }
+    }
+
+    for (int r = 0; r < kTileRegisters; r++) {
+      simd::StoreEpi16(&values[tile + r * kChunkSize], registers[r]);
+    }
+  }
+#else
+  for (int i = 0; i < Arch::kL1Size; ++i) {
+    I16 value = previous[i];
+    for (int j = 0; j < num_adds; j++) value += adds[j][i] * feature_scale;
+    for (int j = 0; j < num_subs; j++) value -= subs[j][i] * feature_scale;
+    values[i] = value;
+  }
+#endif
+}
+
+template <typename Arch>
+void ActivateFeatures(const I16 *stm_perspective,
+                      const I16 *nstm_perspective,
+                      Activations<Arch> &feature_output) {
+  constexpr int kFtShift = arch::kFtShift;
+
+#if BUILD_HAS_SIMD
+  constexpr int kI16ChunkSize = sizeof(simd::Vepi16) / sizeof(I16);
+  constexpr int kI8ChunkSize = sizeof(simd::Vepi16) / sizeof(I8);
+
+  const auto quantise_vector = simd::SetEpi16(arch::kFtQuantization);
+
+  for (int them = 0; them <= 1; them++) {
+    const auto stm_accumulator = them ? nstm_perspective : stm_perspective;
+    for (int i = 0; i < Arch::kL1Size / 2; i += kI8ChunkSize) {
+      // Clip first accumulator values
+      const auto accumulator_value = simd::LoadEpi16(&stm_accumulator[i]);
+      const auto pair_accumulator_value =
+          simd::LoadEpi16(&stm_accumulator[i + Arch::kL1Size / 2]);
+      const auto clipped_value =
+          simd::Clip(accumulator_value, arch::kFtQuantization);
+      const auto clipped_pair_value =
+          simd::Min(pair_accumulator_value, quantise_vector);
+
+      // Clip second accumulator values
+      const auto accumulator_value1 =
+          simd::LoadEpi16(&stm_accumulator[i + kI16ChunkSize]);
+      const auto pair_accumulator_value1 = simd::LoadEpi16(
+          &stm_accumulator[i + Arch::kL1Size / 2 + kI16ChunkSize]);
+      const auto clipped_value1 =
+          simd::Clip(accumulator_value1, arch::kFtQuantization);
+      const auto clipped_pair_value1 =
+          simd::Min(pair_accumulator_value1, quantise_vector);
+
+      // Perform a left-shift on them and multiply the products using the
+      // higher 16 bits
+      const auto first_product = simd::MulhiEpi16(
+          simd::SlliEpi16(clipped_value, 16 - kFtShift), clipped_pair_value);
+      const auto second_product = simd::MulhiEpi16(
+          simd::SlliEpi16(clipped_value1, 16 - kFtShift), clipped_pair_value1);
+
+      // Pack the two I16 vectors into an I8 vector, which will clamp negative
+      // values to 0 because of unsigned saturation. This is why we didn't clamp
+      // the pair values to 0 earlier, effectively saving us an operation
+      auto &features = *reinterpret_cast<simd::Vepi8 *>(
+          &feature_output[i + them * Arch::kL1Size / 2]);
+      features = simd::PackusEpi16(first_product, second_product);
+    }
+  }
+#else
+  // Activate the feature layer via pair-wise CReLU multiplication
+  for (int them = 0; them <= 1; them++) {
+    const auto stm_accumulator = them ? nstm_perspective : stm_perspective;
+    for (int i = 0; i < Arch::kL1Size / 2; i++) {
+      const auto first_val = CReLU(stm_accumulator[i]);
+      const auto second_val = CReLU(stm_accumulator[i + Arch::kL1Size / 2]);
+
+      const auto product = (first_val * second_val) >> kFtShift;
+      feature_output[i + them * Arch::kL1Size / 2] = static_cast<U8>(product);
+    }
+  }
+#endif
+}
+
+template <typename Arch>
+Score Forward(const Network<Arch> &network,
+              const I16 *stm_perspective,
+              const I16 *nstm_perspective,
+              int bucket,
+              OutputTail tail) {
+  // Activate the feature layer neurons
+  alignas(simd::kAlignment) Activations<Arch> feature_output{};
+  ActivateFeatures<Arch>(stm_perspective, nstm_perspective, feature_output);
+
+#if BUILD_HAS_SIMD
+  constexpr int kF32ChunkSize = sizeof(simd::Vepi16) / sizeof(float);
+
+  // Sparse Processing, or NNZ (Number of Non-Zero), is an optimization we
+  // perform to minimize the amount of computation done by only mat-mulling
+  // the positive, non-zero activated features with the next layer's weights
+  sparse::NnzIndices<Arch> nnz_indices;
+  const int nnz_count = sparse::FindNnz<Arch>(feature_output, nnz_indices);
+
+  // Forward the feature layer neurons to the 2nd layer
+  alignas(simd::kAlignment) std::array<I32, Arch::kL2Size> l1_sums{};
+  sparse::PropagateL1<Arch>(
+      network, bucket, feature_output, nnz_indices, nnz_count, l1_sums);
+
+  if (tail == OutputTail::kInteger) {
+    return EvaluateIntegerTail<Arch>(network, l1_sums, bucket);
+  }
+
+  const auto zero_float_vector = simd::ZeroPs(),
+             one_float_vector = simd::SetPs(1.0f);
+
+  alignas(simd::kAlignment) std::array<float, Arch::kL2Size> l1_output{};
+  ActivateL1<Arch>(network, bucket, l1_sums, l1_output);
+
+  // Forward the feature layer neurons to the 2nd layer
+  alignas(simd::kAlignment) std::array<float, Arch::kL3Size> l2_sums;
+  std::memcpy(
+      l2_sums.data(), network.l2_biases[bucket].data(), sizeof(l2_sums));
+
+  for (int i = 0; i < Arch::kL2Size; i++) {
+    const auto l1_vector = simd::SetPs(l1_output[i]);
+    for (int j = 0; j < Arch::kL3Size; j += kF32ChunkSize) {
+      const auto weight_vector = *reinterpret_cast<const simd::Vepf32 *>(
+          &network.l2_weights[bucket][i][j]);
+      auto &features = *reinterpret_cast<simd::Vepf32 *>(&l2_sums[j]);
+      features = simd::MultiplyAddPs(weight_vector, l1_vector, features);
+    }
+  }
+
+  alignas(simd::kAlignment) std::array<float, Arch::kL3Size> l2_output;
+  for (int i = 0; i < Arch::kL3Size; i += kF32ChunkSize) {
+    const auto &sum_vector = *reinterpret_cast<simd::Vepf32 *>(&l2_sums[i]);
+    auto &features = *reinterpret_cast<simd::Vepf32 *>(&l2_output[i]);
+    features = simd::MinPs(simd::MaxPs(sum_vector, zero_float_vector),
+                           one_float_vector);
+  }
+
+  // Forward the feature layer neurons to the 3rd (final) layer
+  constexpr int kResultChunks = 64 / sizeof(simd::Vepf32);
+  const auto zero_ps = simd::SetPs(0.0f);
+
+  alignas(simd::kAlignment) std::array<simd::Vepf32, kResultChunks> result_sums;
+  result_sums.fill(zero_ps);
+
+  for (int i = 0; i < Arch::kL3Size / kF32ChunkSize; i += kResultChunks) {
+    for (int chunk = 0; chunk < kResultChunks; chunk++) {
+      const auto weight_vector = *reinterpret_cast<const simd::Vepf32 *>(
+          &network.l3_weights[bucket][(i + chunk) * kF32ChunkSize]);
+      const auto &l2_vector = *reinterpret_cast<simd::Vepf32 *>(
+          &l2_output[(i + chunk) * kF32ChunkSize]);
+      result_sums[chunk] =
+          simd::MultiplyAddPs(l2_vector, weight_vector, result_sums[chunk]);
+    }
+  }
+
+  const auto l3_output =
+      simd::ReduceAddPs(result_sums.data()) + network.l3_biases[bucket];
+
+  return static_cast<Score>(l3_output * arch::kEvalScale);
+
+#else
+  const float kL1Normalization =
+      static_cast<float>(1 << arch::kFtShift) /
+      static_cast<float>(arch::kFtQuantization * arch::kFtQuantization *
+                         arch::kL1Quantization);
+
+  // Forward the feature layer neurons to the 2nd layer
+  std::array<I32, Arch::kL2Size> l1_sums{};
+  for (int i = 0; i < Arch::kL1Size; i++) {
+    if (!feature_output[i]) continue;
+
+    for (int j = 0; j < Arch::kL2Size; j++) {
+      l1_sums[j] += feature_output[i] * network.l1_weights[bucket][i][j];
+    }
+  }
+
+  if (tail == OutputTail::kInteger) {
+    return EvaluateIntegerTail<Arch>(network, l1_sums, bucket);
+  }
+
+  // Activate 2nd layer neurons
+  std::array<float, Arch::kL2Size> l1_output{};
+  for (int i = 0; i < Arch::kL2Size; i++) {
+    l1_output[i] = CReLU(static_cast<float>(l1_sums[i]) * kL1Normalization +
+                         network.l1_biases[bucket][i]);
+  }
+
+  // Forward the 2nd layer neurons to the 3rd layer
+  std::array<float, Arch::kL3Size> l2_output{};
+  std::memcpy(
+      l2_output.data(), network.l2_biases[bucket].data(), sizeof(l2_output));
+  for (int i = 0; i < Arch::kL2Size; i++) {
+    for (int j = 0; j < Arch::kL3Size; j++) {
+      l2_output[j] = std::fma(
+          l1_output[i], network.l2_weights[bucket][i][j], l2_output[j]);
+    }
+  }
+
+  // Forward 3rd layer neurons to output layer
+  constexpr int kResultChunks = 64 / sizeof(float);
+  std::array<float, kResultChunks> result_sums{};
+
+  for (int i = 0; i < Arch::kL3Size; i += kResultChunks) {
+    for (int chunk = 0; chunk < kResultChunks; chunk++) {
+      const float activated = CReLU(l2_output[i + chunk]);
+      result_sums[chunk] = std::fma(activated,
+                                    network.l3_weights[bucket][i + chunk],
+                                    result_sums[chunk]);
+    }
+  }
+
+  const float l3_output =
+      network.l3_biases[bucket] +
+      simd::ReduceAddPsRecursive(result_sums.data(), kResultChunks);
+
+  // Scale output
+  return static_cast<Score>(l3_output * arch::kEvalScale);
+#endif
+}
+
+// The layers run one at a time over the whole batch, so that each block of
+// weights is loaded once and then applied to every position it's needed by
+template <typename Arch>
+void ForwardBatch(const Network<Arch> &network,
+                  const Activations<Arch> *const *features,
+                  int count,
+                  int bucket,
+                  OutputTail tail,
+                  Score *scores) {
+  assert(count <= kMaxBatchSize);
+
+#if BUILD_HAS_SIMD
+  constexpr int kI32ChunkSize = sizeof(simd::Vepi32) / sizeof(I32);
+  constexpr int kF32ChunkSize = sizeof(simd::Vepi16) / sizeof(float);
+
+  // Forward the feature layer neurons to the 2nd layer, one group of four
+  // neurons at a time. Positions where the whole group is zero skip it, like
+  // the sparse path of Forward does
+  constexpr int kL1Registers = Arch::kL2Size / kI32ChunkSize;
+  alignas(simd::kAlignment)
+      std::array<std::array<I32, Arch::kL2Size>, kMaxBatchSize> l1_sums{};
+  for (int group = 0; group < Arch::kL1Size / 4; group++) {
+    simd::Vepi8 weights[kL1Registers];
+    for (int r = 0; r < kL1Registers; r++) {
+      weights[r] = *reinterpret_cast<const simd::Vepi8 *>(
+          &network.l1_weights[bucket][group * 4 + r * kI32ChunkSize / 4]);
+    }
+
+    for (int p = 0; p < count; p++) {
+      I32 inputs;
+      std::memcpy(&inputs, &(*features[p])[group * 4], sizeof(inputs));
+      if (!inputs) continue;
+
+      const auto input_vector = simd::SetEpi32(inputs);
+      for (int r = 0; r < kL1Registers; r++) {
+        I32 *sums = &l1_sums[p][r * kI32ChunkSize];
+        simd::StoreEpi32(sums,
+                         simd::DpbusdEpi32(simd::LoadEpi32(sums),
+                                           input_vector,
+                                           weights[r]));
+      }
+    }
+  }
+
+  if (tail == OutputTail::kInteger) {
+    EvaluateIntegerTailBatch<Arch>(network, l1_sums, count, bucket, scores);
+    return;
+  }
+
+  const auto zero_float_vector = simd::ZeroPs(),
+             one_float_vector = simd::SetPs(1.0f);
+
+  alignas(simd::kAlignment)
+      std::array<std::array<float, Arch::kL2Size>, kMaxBatchSize> l1_output;
+  alignas(simd::kAlignment)
+      std::array<std::array<float, Arch::kL3Size>, kMaxBatchSize> l2_sums;
+  for (int p = 0; p < count; p++) {
+    ActivateL1<Arch>(network, bucket, l1_sums[p], l1_output[p]);
+    std::memcpy(l2_sums[p].data(),
+                network.l2_biases[bucket].data(),
+                sizeof(l2_sums[p]));
+  }
+
+  // Forward the 2nd layer neurons to the 3rd layer, one row of weights at a
+  // time
+  constexpr int kL3Registers = Arch::kL3Size / kF32ChunkSize;
+  for (int i = 0; i < Arch::kL2Size; i++) {
+    simd::Vepf32 weights[kL3Registers];
+    for (int r = 0; r < kL3Registers; r++) {
+      weights[r] = *reinterpret_cast<const simd::Vepf32 *>(
+          &network.l2_weights[bucket][i][r * kF32ChunkSize]);
+    }
+
+    for (int p = 0; p < count; p++) {
+      const auto l1_vector = simd::SetPs(l1_output[p][i]);
+      for (int r = 0; r < kL3Registers; r++) {
+        auto &sums =
+            *reinterpret_cast<simd::Vepf32 *>(&l2_sums[p][r * kF32ChunkSize]);
+        sums = simd::MultiplyAddPs(weights[r], l1_vector, sums);
+      }
+    }
+  }
+
+  // Forward the 3rd layer neurons to the output, summing in the same order as
+  // Forward so that both give the same scores
+  constexpr int kResultChunks = 64 / sizeof(simd::Vepf32);
+  simd::Vepf32 l3_weights[kL3Registers];
+  for (int r = 0; r < kL3Registers; r++) {
+    l3_weights[r] = *reinterpret_cast<const simd::Vepf32 *>(
+        &network.l3_weights[bucket][r * kF32ChunkSize]);
+  }
+
+  for (int p = 0; p < count; p++) {
+    simd::Vepf32 result_sums[kResultChunks];
+    for (int chunk = 0; chunk < kResultChunks; chunk++) {
+      result_sums[chunk] = simd::ZeroPs();
+    }
+
+    for (int r = 0; r < kL3Registers; r++) {
+      const auto &sum_vector =
+          *reinterpret_cast<simd::Vepf32 *>(&l2_sums[p][r * kF32ChunkSize]);
+      const auto l2_vector = simd::MinPs(
+          simd::MaxPs(sum_vector, zero_float_vector), one_float_vector);
+      result_sums[r % kResultChunks] = simd::MultiplyAddPs(
+          l2_vector, l3_weights[r], result_sums[r % kResultChunks]);
+    }
+
+    const auto l3_output =
+        simd::ReduceAddPs(result_sums) + network.l3_biases[bucket];
+    scores[p] = static_cast<Score>(l3_output * arch::kEvalScale);
+  }
+
+#else
+  // Forward the feature layer neurons to the 2nd layer, one row of weights at
+  // a time
+  std::array<std::array<I32, Arch::kL2Size>, kMaxBatchSize> l1_sums{};
+  for (int i = 0; i < Arch::kL1Size; i++) {
+    const auto &weights = network.l1_weights[bucket][i];
+    for (int p = 0; p < count; p++) {
+      const U8 input = (*features[p])[i];
+      if (!input) continue;
+
+      for (int j = 0; j < Arch::kL2Size; j++) {
+        l1_sums[p][j] += input * weights[j];
+      }
+    }
+  }
+
+  if (tail == OutputTail::kInteger) {
+    EvaluateIntegerTailBatch<Arch>(network, l1_sums, count, bucket, scores);
+    return;
+  }
+
+  const float kL1Normalization =
+      static_cast<float>(1 << arch::kFtShift) /
+      static_cast<float>(arch::kFtQuantization * arch::kFtQuantization *
+                         arch::kL1Quantization);
+
+  // Activate 2nd layer neurons
+  std::array<std::array<float, Arch::kL2Size>, kMaxBatchSize> l1_output;
+  std::array<std::array<float, Arch::kL3Size>, kMaxBatchSize> l2_output;
+  for (int p = 0; p < count; p++) {
+    for (int i = 0; i < Arch::kL2Size; i++) {
+      l1_output[p][i] =
+          CReLU(static_cast<float>(l1_sums[p][i]) * kL1Normalization +
+                network.l1_biases[bucket][i]);
+    }
+    std::memcpy(l2_output[p].data(),
+                network.l2_biases[bucket].data(),
+                sizeof(l2_output[p]));
+  }
+
+  // Forward the 2nd layer neurons to the 3rd layer
+  for (int i = 0; i < Arch::kL2Size; i++) {
+    const auto &weights = network.l2_weights[bucket][i];
+    for (int p = 0; p < count; p++) {
+      for (int j = 0; j < Arch::kL3Size; j++) {
+        l2_output[p][j] = std::fma(l1_output[p][i], weights[j], l2_output[p][j]);
+      }
+    }
+  }
+
+  // Forward 3rd layer neurons to output layer
+  constexpr int kResultChunks = 64 / sizeof(float);
+  for (int p = 0; p < count; p++) {
+    std::array<float, kResultChunks> result_sums{};
+    for (int i = 0; i < Arch::kL3Size; i += kResultChunks) {
+      for (int chunk = 0; chunk < kResultChunks; chunk++) {
+        const float activated = CReLU(l2_output[p][i + chunk]);
+        result_sums[chunk] = std::fma(activated,
+                                      network.l3_weights[bucket][i + chunk],
+                                      result_sums[chunk]);
+      }
+    }
+
+    const float l3_output =
+        network.l3_biases[bucket] +
+        simd::ReduceAddPsRecursive(result_sums.data(), kResultChunks);
+    scores[p] = static_cast<Score>(l3_output * arch::kEvalScale);
+  }
+#endif
+}
+
+template <typename Arch>
+void ProcessNetwork(const RawNetwork<Arch> *raw_network,
+                    Network<Arch> *network) {
+  ::nnue::ProcessNetwork<Arch>(raw_network, *network);
+}
+
+template <typename Arch>
+void CountActivations(const I16 *perspective, U64 *counts) {
+  constexpr int kPairCount = Arch::kL1Size / 2;
+  for (int i = 0; i < kPairCount; i++) {
+    const auto product =
+        (CReLU(perspective[i]) * CReLU(perspective[i + kPairCount])) >>
+        arch::kFtShift;
+    counts[RawNeuronIndex(i)] += product > 0;
+  }
+}
+
+template <typename Arch>
+const KernelTable<Arch> &Table() {
+  static constexpr KernelTable<Arch> kTable = {
+      .name = KERNELS_STRINGIFY(SIMD_TIER),
+      .apply_rows = ApplyRows<Arch>,
+      .forward = Forward<Arch>,
+      .activate_features = ActivateFeatures<Arch>,
+      .forward_batch = ForwardBatch<Arch>,
+      .process_network = ProcessNetwork<Arch>,
+      .count_activations = CountActivations<Arch>,
+      .processed_layout = kProcessedLayout,
+  };
+  return kTable;
+}
+
+// Every architecture the engine evaluates needs its kernels instantiated here
+#define INSTANTIATE_KERNELS(Arch)                                             \
+  template void ApplyRows<Arch>(I16 *,                                        \
+                                const I16 *,                                  \
+                                FeatureWeight const *const *,                 \
+                                int,                                          \
+                                FeatureWeight const *const *,                 \
+                                int,                                          \
+                                I16);                                         \
+  template Score Forward<Arch>(                                               \
+      const Network<Arch> &, const I16 *, const I16 *, int, OutputTail);      \
+  template void ActivateFeatures<Arch>(                                       \
+      const I16 *, const I16 *, Activations<Arch> &);                         \
+  template void ForwardBatch<Arch>(const Network<Arch> &,                     \
+                                   const Activations<Arch> *const *,          \
+                                   int,                                       \
+                                   int,                                       \
+                                   OutputTail,                                \
+                                   Score *);                                  \
+  template void ProcessNetwork<Arch>(const RawNetwork<Arch> *,                \
+                                     Network<Arch> *);                        \
+  template void CountActivations<Arch>(const I16 *, U64 *);                   \
+  template const KernelTable<Arch> &Table<Arch>();
+
+INSTANTIATE_KERNELS(MainArch)
+#ifdef EVALFILE_SMALL
+INSTANTIATE_KERNELS(SmallArch)
+#endif
+
+#undef INSTANTIATE_KERNELS
+
+}  // namespace nnue::kernels::SIMD_TIER
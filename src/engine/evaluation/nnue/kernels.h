@@ -0,0 +1,247 @@
+#ifndef INTEGRAL_NNUE_KERNELS_H
+#define INTEGRAL_NNUE_KERNELS_H
+
+#include <array>
+
+#include "../../../../shared/nnue/definitions.h"
+#include "../../../../shared/simd.h"
+
+// The parts of the network whose speed depends on the instruction set. Normal
+// builds call the kernels compiled for their own architecture, while fat
+// builds (BUILD_FAT) compile kernels.cc once per tier and call the best one
+// the CPU supports through a table picked at startup. Tiers are compiled for
+// newer CPUs than the rest of the engine, so nothing but the network
+// definitions and raw pointers cross into them, and no inline engine or
+// library code they emit can stand in for the baseline copy
+namespace nnue::kernels {
+
+// Outputs of the feature layer for both perspectives, the side to move's first
+template <typename Arch>
+using Activations = std::array<U8, Arch::kL1Size>;
+
+// The most positions ForwardBatch runs through the network at once
+constexpr int kMaxBatchSize = 32;
+
+template <typename Arch>
+struct KernelTable {
+  const char* name;
+  // Applies add and sub rows of a single input bucket on top of previous
+  void (*apply_rows)(I16* values,
+                     const I16* previous,
+                     FeatureWeight const* const* adds,
+                     int num_adds,
+                     FeatureWeight const* const* subs,
+                     int num_subs,
+                     I16 feature_scale);
+  // Runs the network on up-to-date accumulators of the side to move and of
+  // its opponent
+  Score (*forward)(const Network<Arch>& network,
+                   const I16* stm_perspective,
+                   const I16* nstm_perspective,
+                   int bucket,
+                   OutputTail tail);
+  // Activates the feature layer of the same accumulators into features
+  void (*activate_features)(const I16* stm_perspective,
+                            const I16* nstm_perspective,
+                            Activations<Arch>& features);
+  // Runs L1-L3 of one output bucket on up to kMaxBatchSize positions, loading
+  // each block of weights once for all of them
+  void (*forward_batch)(const Network<Arch>& network,
+                        const Activations<Arch>* const* features,
+                        int count,
+                        int bucket,
+                        OutputTail tail,
+                        Score* scores);
+  // Converts a network in the trainer's raw format into the layout the other
+  // kernels of the tier expect
+  void (*process_network)(const RawNetwork<Arch>* raw_network,
+                          Network<Arch>* network);
+  // Adds the pairs of L1 neurons that one perspective's accumulator activates
+  // to counts, indexed in the raw network's order
+  void (*count_activations)(const I16* perspective, U64* counts);
+  // Identifies that layout in the headers of processed networks
+  U32 processed_layout;
+};
+
+// The kernels are only instantiated for the architectures kernels.cc lists
+namespace SIMD_TIER {
+
+template <typename Arch>
+void ApplyRows(I16* values,
+               const I16* previous,
+               FeatureWeight const* const* adds,
+               int num_adds,
+               FeatureWeight const* const* subs,
+               int num_subs,
+               I16 feature_scale);
+
+template <typename Arch>
+Score Forward(const Network<Arch>& network,
+              const I16* stm_perspective,
+              const I16* nstm_perspective,
+              int bucket,
+              OutputTail tail);
+
+template <typename Arch>
+void ActivateFeatures(const I16* stm_perspective,
+                      const I16* nstm_perspective,
+                      Activations<Arch>& features);
+
+template <typename Arch>
+void ForwardBatch(const Network<Arch>& network,
+                  const Activations<Arch>* const* features,
+                  int count,
+                  int bucket,
+                  OutputTail tail,
+                  Score* scores);
+
+template <typename Arch>
+void ProcessNetwork(const RawNetwork<Arch>* raw_network,
+                    Network<Arch>* network);
+
+template <typename Arch>
+void CountActivations(const I16* perspective, U64* counts);
+
+template <typename Arch>
+[[nodiscard]] const KernelTable<Arch>& Table();
+
+}  // namespace SIMD_TIER
+
+#ifdef BUILD_FAT
+// The tiers built on top of the baseline one, from the best to the worst
+namespace vnni512 {
+template <typename Arch>
+[[nodiscard]] const KernelTable<Arch>& Table();
+}
+
+namespace avx512 {
+template <typename Arch>
+[[nodiscard]] const KernelTable<Arch>& Table();
+}
+
+namespace avx2 {
+template <typename Arch>
+[[nodiscard]] const KernelTable<Arch>& Table();
+}
+
+enum class Tier {
+  kBaseline,
+  kAvx2,
+  kAvx512,
+  kVnni512
+};
+
+// The best tier the CPU supports
+[[nodiscard]] Tier DetectTier();
+
+template <typename Arch>
+[[nodiscard]] const KernelTable<Arch>* SelectKernels() {
+  switch (DetectTier()) {
+    case Tier::kVnni512:
+      return &vnni512::Table<Arch>();
+    case Tier::kAvx512:
+      return &avx512::Table<Arch>();
+    case Tier::kAvx2:
+      return &avx2::Table<Arch>();
+    default:
+      return &SIMD_TIER::Table<Arch>();
+  }
+}
+
+// The kernels of the best tier for each architecture, picked before main runs
+template <typename Arch>
+inline const KernelTable<Arch>* const selected = SelectKernels<Arch>();
+#endif
+
+template <typename Arch>
+[[nodiscard]] const KernelTable<Arch>& Selected() {
+#ifdef BUILD_FAT
+  return *selected<Arch>;
+#else
+  return SIMD_TIER::Table<Arch>();
+#endif
+}
+
+template <typename Arch>
+void ApplyRows(I16* values,
+               const I16* previous,
+               FeatureWeight const* const* adds,
+               int num_adds,
+               FeatureWeight const* const* subs,
+               int num_subs,
+               I16 feature_scale) {
+#ifdef BUILD_FAT
+  selected<Arch>->apply_rows(
+      values, previous, adds, num_adds, subs, num_subs, feature_scale);
+#else
+  SIMD_TIER::ApplyRows<Arch>(
+      values, previous, adds, num_adds, subs, num_subs, feature_scale);
+#endif
+}
+
+template <typename Arch>
+Score Forward(const Network<Arch>& network,
+              const I16* stm_perspective,
+              const I16* nstm_perspective,
+              int bucket,
+              OutputTail tail) {
+#ifdef BUILD_FAT
+  return selected<Arch>->forward(
+      network, stm_perspective, nstm_perspective, bucket, tail);
+#else
+  return SIMD_TIER::Forward<Arch>(
+      network, stm_perspective, nstm_perspective, bucket, tail);
+#endif
+}
+
+template <typename Arch>
+void ActivateFeatures(const I16* stm_perspective,
+                      const I16* nstm_perspective,
+                      Activations<Arch>& features) {
+#ifdef BUILD_FAT
+  selected<Arch>->activate_features(
+      stm_perspective, nstm_perspective, features);
+#else
+  SIMD_TIER::ActivateFeatures<Arch>(
+      stm_perspective, nstm_perspective, features);
+#endif
+}
+
+template <typename Arch>
+void ForwardBatch(const Network<Arch>& network,
+                  const Activations<Arch>* const* features,
+                  int count,
+                  int bucket,
+                  OutputTail tail,
+                  Score* scores) {
+#ifdef BUILD_FAT
+  selected<Arch>->forward_batch(
+      network, features, count, bucket, tail, scores);
+#else
+  SIMD_TIER::ForwardBatch<Arch>(
+      network, features, count, bucket, tail, scores);
+#endif
+}
+
+template <typename Arch>
+void ProcessNetwork(const RawNetwork<Arch>* raw_network,
+                    Network<Arch>* network) {
+#ifdef BUILD_FAT
+  selected<Arch>->process_network(raw_network, network);
+#else
+  SIMD_TIER::ProcessNetwork<Arch>(raw_network, network);
+#endif
+}
+
+template <typename Arch>
+void CountActivations(const I16* perspective, U64* counts) {
+#ifdef BUILD_FAT
+  selected<Arch>->count_activations(perspective, counts);
+#else
+  SIMD_TIER::CountActivations<Arch>(perspective, counts);
+#endif
+}
+
+}  // namespace nnue::kernels
+
+#endif  // INTEGRAL_NNUE_KERNELS_H
@@ -1,8 +1,17 @@
 #include "nnue.h"
 
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string_view>
+
 #include "../../../../shared/nnue/definitions.h"
 #include "../../../../shared/simd.h"
 #include "accumulator.h"
+#include "kernels.h"
 
 #ifdef _MSC_VER
 #define SP_MSVC
@@ -11,7 +20,6 @@
 #endif
 
 #include "../../../third-party/incbin/incbin.h"
-#include "sparse.h"
 
 #ifdef SP_MSVC
 #pragma pop_macro("_MSC_VER")
@@ -19,341 +27,410 @@
 #endif
 
 INCBIN(EVAL, EVALFILE);
+#ifdef EVALFILE_SMALL
+INCBIN(EVAL_SMALL, EVALFILE_SMALL);
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "fmt/format.h"
 
 namespace nnue {
 
-[[nodiscard]] I32 CReLU(I16 value) {
-  return std::clamp<I32>(value, 0, arch::kFtQuantization);
+#ifdef BUILD_FAT
+namespace kernels {
+
+Tier DetectTier() {
+  // This runs before main, possibly before the CPU model is known
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("x86-64-v4")) {
+    if (__builtin_cpu_supports("avx512vnni") &&
+        __builtin_cpu_supports("avx512vbmi2")) {
+      return Tier::kVnni512;
+    }
+    return Tier::kAvx512;
+  }
+  if (__builtin_cpu_supports("x86-64-v3")) {
+    return Tier::kAvx2;
+  }
+  return Tier::kBaseline;
 }
 
-[[nodiscard]] float CReLU(float value) {
-  return std::clamp(value, 0.0f, 1.0f);
+}  // namespace kernels
+#endif
+
+namespace {
+
+std::mutex node_networks_mutex;
+template <typename Arch>
+std::vector<std::unique_ptr<Network<Arch>>> node_networks;
+
+// The network loaded at runtime through EvalFile, if any
+template <typename Arch>
+std::unique_ptr<Network<Arch>> loaded_network;
+std::string loaded_network_path;
+
+// Converts a raw network with the kernels picked for this CPU
+template <typename Arch>
+std::unique_ptr<Network<Arch>> ProcessRawNetwork(
+    const RawNetwork<Arch>* raw_network) {
+  auto processed_network = std::make_unique<Network<Arch>>();
+  kernels::ProcessNetwork<Arch>(raw_network, processed_network.get());
+  return processed_network;
 }
 
-void LoadFromIncBin() {
-  // Load raw network from binary data
-  network = reinterpret_cast<Network*>(const_cast<unsigned char*>(gEVALData));
+template <typename Arch>
+void SwapNetwork(Network<Arch>* new_network) {
+  network<Arch> = new_network;
+  ++network_version;
+
+  // The per-node copies are of the old network, so the search threads must
+  // be respawned to make new ones
+  std::lock_guard lock(node_networks_mutex);
+  node_networks<Arch>.clear();
 }
 
-Score Evaluate(Board &board) {
-  auto &state = board.GetState();
-  auto &accumulator = *board.GetAccumulator();
-
-  accumulator.ApplyChanges();
-  const auto bucket = accumulator.GetOutputBucket(state);
-
-  constexpr int kFtShift = 9;
-
-#if BUILD_HAS_SIMD and !defined(SPARSE_PERMUTE)
-  constexpr int kI32ChunkSize = sizeof(simd::Vepi16) / sizeof(I32);
-  constexpr int kI16ChunkSize = sizeof(simd::Vepi16) / sizeof(I16);
-  constexpr int kI8ChunkSize = sizeof(simd::Vepi16) / sizeof(I8);
-  constexpr int kF32ChunkSize = sizeof(simd::Vepi16) / sizeof(float);
-
-  const auto quantise_vector = simd::SetEpi16(arch::kFtQuantization);
-
-  std::array<U16, arch::kL1Size / 4> nnz_indices{};
-  int nnz_count = 0;
-  auto nnz_base = _mm_setzero_si128();
-  const auto lookup_increment = _mm_set1_epi16(8);
-
-  // Activate the feature layer neurons
-  alignas(simd::kAlignment) std::array<U8, arch::kL1Size> feature_output{};
-  for (int them = 0; them <= 1; them++) {
-    const auto &stm_accumulator = accumulator[state.turn ^ them];
-    for (int i = 0; i < arch::kL1Size / 2; i += kI8ChunkSize) {
-      // Clip first accumulator values
-      const auto accumulator_value = simd::LoadEpi16(&stm_accumulator[i]);
-      const auto pair_accumulator_value =
-          simd::LoadEpi16(&stm_accumulator[i + arch::kL1Size / 2]);
-      const auto clipped_value =
-          simd::Clip(accumulator_value, arch::kFtQuantization);
-      const auto clipped_pair_value =
-          simd::Min(pair_accumulator_value, quantise_vector);
-
-      // Clip second accumulator values
-      const auto accumulator_value1 =
-          simd::LoadEpi16(&stm_accumulator[i + kI16ChunkSize]);
-      const auto pair_accumulator_value1 = simd::LoadEpi16(
-          &stm_accumulator[i + arch::kL1Size / 2 + kI16ChunkSize]);
-      const auto clipped_value1 =
-          simd::Clip(accumulator_value1, arch::kFtQuantization);
-      const auto clipped_pair_value1 =
-          simd::Min(pair_accumulator_value1, quantise_vector);
-
-      // Perform a left-shift on them and multiply the products using the
-      // higher 16 bits
-      const auto first_product = simd::MulhiEpi16(
-          simd::SlliEpi16(clipped_value, 16 - kFtShift), clipped_pair_value);
-      const auto second_product = simd::MulhiEpi16(
-          simd::SlliEpi16(clipped_value1, 16 - kFtShift), clipped_pair_value1);
-
-      // Pack the two I16 vectors into an I8 vector, which will clamp negative
-      // values to 0 because of unsigned saturation. This is why we didn't clamp
-      // the pair values to 0 earlier, effectively saving us an operation
-      auto &features = *reinterpret_cast<simd::Vepi8 *>(
-          &feature_output[i + them * arch::kL1Size / 2]);
-      features = simd::PackusEpi16(first_product, second_product);
-
-      // Sparse Processing, or NNZ (Number of Non-Zero), is an optimization we
-      // perform to minimize the amount of computation done by only mat-mulling
-      // the positive, non-zero activated features with the next layer's weights
-      // -----------------------------------------------------------------------
-      // Get a mask of all positive, non-zero elements
-      // Each bit in `nnz_mask` corresponds to whether a specific feature is
-      // positive (1) or zero (0)
-      const auto nnz_mask = simd::GetNnzMask(features);
-      
-#if defined(__AVX2__)
-      // Optimized sparse processing using AVX2 instructions
-      // Convert mask to indices directly using bit manipulation
-      if (nnz_mask) {
-        // Use PDEP to scatter set bits to byte positions
-        const U64 expanded = _pdep_u64(0x0706050403020100ULL, nnz_mask);
-        const int popcount = __builtin_popcountll(nnz_mask);
-        
-        // Store indices efficiently
-        const auto base_vec = _mm_set1_epi16(i + them * arch::kL1Size / 2);
-        const auto idx_vec = _mm_cvtepu8_epi16(_mm_set_epi64x(0, expanded));
-        const auto abs_indices = _mm_add_epi16(base_vec, idx_vec);
-        _mm_storeu_si128(reinterpret_cast<__m128i *>(&nnz_indices[nnz_count]), abs_indices);
-        nnz_count += popcount;
+// Maps the file read-only, or reads it into memory where mmap isn't available
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& path) {
+#if defined(__linux__) || defined(__APPLE__)
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat status {};
+    if (fstat(fd, &status) == 0 && status.st_size > 0) {
+      void* ptr = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr != MAP_FAILED) {
+        data_ = static_cast<const char*>(ptr);
+        size_ = status.st_size;
       }
+    }
+    close(fd);
 #else
-      // Original implementation for non-AVX2 builds
-      // Loop through 8-bit (U8) slices of this 16-bit mask
-      for (int chunk = 0; chunk < kI32ChunkSize; chunk += 8) {
-        // Extract the 8-bit slice from the mask
-        const U8 slice = (nnz_mask >> chunk) & 0xFF;
-        // Lookup the relative indices for each set bit in the mask, essentially
-        // retrieving the indices for each positive element as an 8-element
-        // vector of I16s
-        const auto indices = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
-            &sparse::nnz_table[slice].indices));
-        // Store these absolute indices into our table. We account for the fact
-        // that they are relative indices (to this slice) by adding `nnz_base`,
-        // which will reflect the position each element is in the entire table
-        _mm_storeu_si128(reinterpret_cast<__m128i *>(&nnz_indices[nnz_count]),
-                         _mm_add_epi16(nnz_base, indices));
-        // Update to reflect the total number of non-zero features processed
-        nnz_count += BitBoard(slice).PopCount();
-        // Increment to reflect the starting index of the next slice
-        nnz_base = _mm_add_epi16(nnz_base, lookup_increment);
-      }
-#endif
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) return;
+    buffer_.resize(file.tellg());
+    file.seekg(0);
+    if (file.read(buffer_.data(), buffer_.size())) {
+      data_ = buffer_.data();
+      size_ = buffer_.size();
     }
+#endif
   }
 
-#ifdef SPARSE_PERMUTE
-  sparse::CountActivations(feature_output);
+  ~MappedFile() {
+#if defined(__linux__) || defined(__APPLE__)
+    if (data_) munmap(const_cast<char*>(data_), size_);
 #endif
+  }
 
-  // Forward the feature layer neurons to the 2nd layer
-  alignas(simd::kAlignment) std::array<I32, arch::kL2Size> l1_sums{};
-  {
-    int i = 0;
-#if defined(__AVX2__)
-    // Process 4 features at a time with AVX2
-    for (; i < nnz_count - 3; i += 4) {
-      const int idx0 = nnz_indices[i] * 4;
-      const int idx1 = nnz_indices[i + 1] * 4;
-      const int idx2 = nnz_indices[i + 2] * 4;
-      const int idx3 = nnz_indices[i + 3] * 4;
-      
-      // Load 4 feature values
-      const auto feature0 = simd::SetEpi32(*reinterpret_cast<I32 *>(&feature_output[idx0]));
-      const auto feature1 = simd::SetEpi32(*reinterpret_cast<I32 *>(&feature_output[idx1]));
-      const auto feature2 = simd::SetEpi32(*reinterpret_cast<I32 *>(&feature_output[idx2]));
-      const auto feature3 = simd::SetEpi32(*reinterpret_cast<I32 *>(&feature_output[idx3]));
-      
-      // Process weights with unrolled loop
-      for (int j = 0; j < arch::kL2Size; j += kI32ChunkSize) {
-        const auto weight0 = *reinterpret_cast<simd::Vepi8 *>(&network->l1_weights[bucket][idx0 + j / 4]);
-        const auto weight1 = *reinterpret_cast<simd::Vepi8 *>(&network->l1_weights[bucket][idx1 + j / 4]);
-        const auto weight2 = *reinterpret_cast<simd::Vepi8 *>(&network->l1_weights[bucket][idx2 + j / 4]);
-        const auto weight3 = *reinterpret_cast<simd::Vepi8 *>(&network->l1_weights[bucket][idx3 + j / 4]);
-        
-        auto &sums = *reinterpret_cast<simd::Vepi32 *>(&l1_sums[j]);
-        sums = simd::DpbusdEpi32x2(sums, feature0, weight0, feature1, weight1);
-        sums = simd::DpbusdEpi32x2(sums, feature2, weight2, feature3, weight3);
-      }
-    }
+  [[nodiscard]] const char* Data() const {
+    return data_;
+  }
+
+  [[nodiscard]] std::size_t Size() const {
+    return size_;
+  }
+
+ private:
+  const char* data_ = nullptr;
+  std::size_t size_ = 0;
+#if !defined(__linux__) && !defined(__APPLE__)
+  std::vector<char> buffer_;
 #endif
-    
-    // Process 2 features at a time
-    for (; i < nnz_count - 1; i += 2) {
-      const int idx = nnz_indices[i] * 4, idx_two = nnz_indices[i + 1] * 4;
-      const auto feature_vector =
-          simd::SetEpi32(*reinterpret_cast<I32 *>(&feature_output[idx]));
-      const auto feature_vector_two =
-          simd::SetEpi32(*reinterpret_cast<I32 *>(&feature_output[idx_two]));
-      for (int j = 0; j < arch::kL2Size; j += kI32ChunkSize) {
-        const auto weight_vector = *reinterpret_cast<simd::Vepi8 *>(
-            &network->l1_weights[bucket][idx + j / 4]);
-        const auto weight_vector_two = *reinterpret_cast<simd::Vepi8 *>(
-            &network->l1_weights[bucket][idx_two + j / 4]);
-        auto &features = *reinterpret_cast<simd::Vepi32 *>(&l1_sums[j]);
-        features = simd::DpbusdEpi32x2(features,
-                                       feature_vector,
-                                       weight_vector,
-                                       feature_vector_two,
-                                       weight_vector_two);
-      }
+};
+
+// Make sure the network doesn't contain garbage where the float layers are,
+// which a raw network without a header could
+template <typename Net>
+[[nodiscard]] bool HasFiniteOutputLayers(const Net& network) {
+  const auto is_finite = [](const auto& array) {
+    const auto first = reinterpret_cast<const float*>(&array);
+    return std::all_of(
+        first, first + sizeof(array) / sizeof(float), [](float value) {
+          return std::isfinite(value);
+        });
+  };
+  return is_finite(network.l1_biases) && is_finite(network.l2_weights) &&
+         is_finite(network.l2_biases) && is_finite(network.l3_weights) &&
+         is_finite(network.l3_biases);
+}
+
+[[nodiscard]] std::string DescribeArchitecture(const NetworkHeader& header) {
+  return fmt::format("{}x{}x{} network with {} input and {} output buckets",
+                     header.l1_size,
+                     header.l2_size,
+                     header.l3_size,
+                     header.input_bucket_count,
+                     header.output_bucket_count);
+}
+
+// Where a network starts in a file or in the embedded data, and whether it
+// was already processed for this build
+struct NetworkData {
+  const char* data;
+  bool processed;
+};
+
+// Skips and validates the header of a network if it has one, as written by
+// preprocess, or takes it as a raw network from the trainer otherwise. Prints
+// why and returns nothing if the network can't be loaded into this build
+template <typename Arch>
+std::optional<NetworkData> FindNetwork(const char* data,
+                                       std::size_t size,
+                                       std::string_view name) {
+  NetworkHeader header{};
+  if (size >= sizeof(NetworkHeader)) {
+    std::memcpy(&header, data, sizeof(NetworkHeader));
+  }
+
+  bool processed = false;
+  if (header.magic == NetworkHeader::kMagic) {
+    if (header.version != NetworkHeader::kVersion) {
+      fmt::println("Error: {} has format version {}, expected {}",
+                   name,
+                   header.version,
+                   NetworkHeader::kVersion);
+      return std::nullopt;
     }
 
-    // Handle the remaining features
-    for (; i < nnz_count; i++) {
-      const int idx = nnz_indices[i] * 4;
-      const auto feature_vector =
-          simd::SetEpi32(*reinterpret_cast<I32 *>(&feature_output[idx]));
-      for (int j = 0; j < arch::kL2Size; j += kI32ChunkSize) {
-        const auto weight_vector = *reinterpret_cast<simd::Vepi8 *>(
-            &network->l1_weights[bucket][idx + j / 4]);
-        auto &features = *reinterpret_cast<simd::Vepi32 *>(&l1_sums[j]);
-        features = simd::DpbusdEpi32(features, feature_vector, weight_vector);
-      }
+    if (!header.HasArchitecture<Arch>()) {
+      fmt::println("Error: {} is a {}, expected a {}",
+                   name,
+                   DescribeArchitecture(header),
+                   DescribeArchitecture(NetworkHeader::Make<Arch>(
+                       NetworkHeader::kRawLayout)));
+      return std::nullopt;
+    }
+
+    processed = header.layout != NetworkHeader::kRawLayout;
+    if (processed &&
+        header.layout != kernels::Selected<Arch>().processed_layout) {
+      fmt::println("Error: {} was processed for another instruction set",
+                   name);
+      return std::nullopt;
     }
-  }
 
-  // Quantisation constants to convert to float
-  constexpr float kL1Normalization =
-      static_cast<float>(1 << kFtShift) /
-      static_cast<float>(arch::kFtQuantization * arch::kFtQuantization *
-                         arch::kL1Quantization);
-  const auto l1_multiplier_vector = simd::SetPs(kL1Normalization);
-  const auto zero_float_vector = simd::ZeroPs(),
-             one_float_vector = simd::SetPs(1.0f);
-
-  alignas(simd::kAlignment) std::array<float, arch::kL2Size> l1_output{};
-  for (int i = 0; i < arch::kL2Size; i += kF32ChunkSize) {
-    const auto bias_vector =
-        *reinterpret_cast<simd::Vepf32 *>(&network->l1_biases[bucket][i]);
-    const auto float_vector =
-        simd::ConvertEpi32ToPs(*reinterpret_cast<simd::Vepi32 *>(&l1_sums[i]));
-    const auto casted_sum =
-        simd::MultiplyAddPs(float_vector, l1_multiplier_vector, bias_vector);
-    auto &features = *reinterpret_cast<simd::Vepf32 *>(&l1_output[i]);
-    features = simd::MinPs(simd::MaxPs(casted_sum, zero_float_vector),
-                           one_float_vector);
+    data += sizeof(NetworkHeader);
+    size -= sizeof(NetworkHeader);
   }
 
-  // Forward the feature layer neurons to the 2nd layer
-  alignas(simd::kAlignment) std::array<float, arch::kL3Size> l2_sums;
-  std::memcpy(
-      l2_sums.data(), network->l2_biases[bucket].data(), sizeof(l2_sums));
-
-  for (int i = 0; i < arch::kL2Size; i++) {
-    const auto l1_vector = simd::SetPs(l1_output[i]);
-    for (int j = 0; j < arch::kL3Size; j += kF32ChunkSize) {
-      const auto weight_vector =
-          *reinterpret_cast<simd::Vepf32 *>(&network->l2_weights[bucket][i][j]);
-      auto &features = *reinterpret_cast<simd::Vepf32 *>(&l2_sums[j]);
-      features = simd::MultiplyAddPs(weight_vector, l1_vector, features);
-    }
+  // Trainers may pad raw networks up to a multiple of 64 bytes
+  constexpr std::size_t kMaxPadding = 64;
+  const std::size_t expected_size =
+      processed ? sizeof(Network<Arch>) : sizeof(RawNetwork<Arch>);
+  if (size < expected_size || size >= expected_size + kMaxPadding) {
+    fmt::println(
+        "Error: {} is {} bytes, expected {}", name, size, expected_size);
+    return std::nullopt;
   }
 
-  alignas(simd::kAlignment) std::array<float, arch::kL3Size> l2_output;
-  for (int i = 0; i < arch::kL3Size; i += kF32ChunkSize) {
-    const auto &sum_vector = *reinterpret_cast<simd::Vepf32 *>(&l2_sums[i]);
-    auto &features = *reinterpret_cast<simd::Vepf32 *>(&l2_output[i]);
-    features = simd::MinPs(simd::MaxPs(sum_vector, zero_float_vector),
-                           one_float_vector);
+  return NetworkData{data, processed};
+}
+
+template <typename Arch>
+void UseNodeNetwork(int node) {
+  if (node < 0) {
+    node_network<Arch> = nullptr;
+    return;
   }
 
-  // Forward the feature layer neurons to the 3rd (final) layer
-  constexpr int kResultChunks = 64 / sizeof(simd::Vepf32);
-  const auto zero_ps = simd::SetPs(0.0f);
-
-  alignas(simd::kAlignment) std::array<simd::Vepf32, kResultChunks> result_sums;
-  result_sums.fill(zero_ps);
-
-  for (int i = 0; i < arch::kL3Size / kF32ChunkSize; i += kResultChunks) {
-    for (int chunk = 0; chunk < kResultChunks; chunk++) {
-      const auto weight_vector = *reinterpret_cast<simd::Vepf32 *>(
-          &network->l3_weights[bucket][(i + chunk) * kF32ChunkSize]);
-      const auto &l2_vector = *reinterpret_cast<simd::Vepf32 *>(
-          &l2_output[(i + chunk) * kF32ChunkSize]);
-      result_sums[chunk] =
-          simd::MultiplyAddPs(l2_vector, weight_vector, result_sums[chunk]);
-    }
+  std::lock_guard lock(node_networks_mutex);
+  auto& networks = node_networks<Arch>;
+  if (networks.size() <= node) {
+    networks.resize(node + 1);
   }
 
-  const auto l3_output =
-      simd::ReduceAddPs(result_sums.data()) + network->l3_biases[bucket];
+  // The first thread on each node makes the copy, so its pages are placed on
+  // that node by the first-touch policy
+  if (!networks[node]) {
+    networks[node] = std::make_unique<Network<Arch>>(*network<Arch>);
+  }
+  node_network<Arch> = networks[node].get();
+}
 
-  return static_cast<Score>(l3_output * arch::kEvalScale);
+template <typename Arch>
+void LoadFromIncBin(const unsigned char* data,
+                    std::size_t size,
+                    std::string_view name) {
+  const auto embedded =
+      FindNetwork<Arch>(reinterpret_cast<const char*>(data), size, name);
+  if (!embedded) {
+    std::exit(EXIT_FAILURE);
+  }
 
-#else
-  // Activate the feature layer via pair-wise CReLU multiplication
-  std::array<U8, arch::kL1Size> feature_output{};
-  for (int them = 0; them <= 1; them++) {
-    const auto &stm_accumulator = accumulator[state.turn ^ them];
-    for (int i = 0; i < arch::kL1Size / 2; i++) {
-      const auto first_val = CReLU(stm_accumulator[i]);
-      const auto second_val = CReLU(stm_accumulator[i + arch::kL1Size / 2]);
-
-      const auto product = (first_val * second_val) >> 9;
-      feature_output[i + them * arch::kL1Size / 2] = static_cast<U8>(product);
-    }
+  if (embedded->processed) {
+    SwapNetwork(
+        reinterpret_cast<Network<Arch>*>(const_cast<char*>(embedded->data)));
+  } else {
+    // Fat builds embed the raw network, as its layout depends on the kernels
+    // picked at runtime. It is only converted the first time it's needed
+    static const auto embedded_network = ProcessRawNetwork<Arch>(
+        reinterpret_cast<const RawNetwork<Arch>*>(embedded->data));
+    SwapNetwork(embedded_network.get());
   }
+  loaded_network<Arch>.reset();
+}
+
+}  // namespace
 
-#ifdef SPARSE_PERMUTE
-  sparse::CountActivations(feature_output);
+void LoadFromIncBin() {
+  LoadFromIncBin<MainArch>(gEVALData, gEVALSize, "the embedded network");
+  loaded_network_path.clear();
+#ifdef EVALFILE_SMALL
+  LoadFromIncBin<SmallArch>(
+      gEVAL_SMALLData, gEVAL_SMALLSize, "the embedded small network");
 #endif
+}
 
-  const float kL1Normalization =
-      static_cast<float>(1 << kFtShift) /
-      static_cast<float>(arch::kFtQuantization * arch::kFtQuantization *
-                         arch::kL1Quantization);
+bool LoadFromFile(const std::string& path) {
+  const MappedFile file(path);
+  if (!file.Data()) {
+    fmt::println("Error: could not open network file '{}'", path);
+    return false;
+  }
 
-  // Forward the feature layer neurons to the 2nd layer
-  std::array<I32, arch::kL2Size> l1_sums{};
-  for (int i = 0; i < arch::kL1Size; i++) {
-    if (!feature_output[i]) continue;
+  const auto name = fmt::format("network file '{}'", path);
+  const auto found = FindNetwork<MainArch>(file.Data(), file.Size(), name);
+  if (!found) {
+    return false;
+  }
 
-    for (int j = 0; j < arch::kL2Size; j++) {
-      l1_sums[j] += feature_output[i] * network->l1_weights[bucket][i][j];
+  // Mappings are page aligned, so the network can be read in place
+  std::unique_ptr<Network<MainArch>> new_network;
+  if (found->processed) {
+    const auto processed_network =
+        reinterpret_cast<const Network<MainArch>*>(found->data);
+    if (HasFiniteOutputLayers(*processed_network)) {
+      new_network = std::make_unique<Network<MainArch>>(*processed_network);
+    }
+  } else {
+    const auto raw_network =
+        reinterpret_cast<const RawNetwork<MainArch>*>(found->data);
+    if (HasFiniteOutputLayers(*raw_network)) {
+      new_network = ProcessRawNetwork<MainArch>(raw_network);
     }
   }
 
-  // Activate 2nd layer neurons
-  std::array<float, arch::kL2Size> l1_output{};
-  for (int i = 0; i < arch::kL2Size; i++) {
-    l1_output[i] = CReLU(static_cast<float>(l1_sums[i]) * kL1Normalization +
-                         network->l1_biases[bucket][i]);
+  if (!new_network) {
+    fmt::println("Error: {} is not a valid network", name);
+    return false;
   }
 
-  // Forward the 2nd layer neurons to the 3rd layer
-  std::array<float, arch::kL3Size> l2_output{};
-  std::memcpy(
-      l2_output.data(), network->l2_biases[bucket].data(), sizeof(l2_output));
-  for (int i = 0; i < arch::kL2Size; i++) {
-    for (int j = 0; j < arch::kL3Size; j++) {
-      l2_output[j] = std::fma(
-          l1_output[i], network->l2_weights[bucket][i][j], l2_output[j]);
+  SwapNetwork(new_network.get());
+  // Only release the old network once nothing points to it anymore
+  loaded_network<MainArch> = std::move(new_network);
+  loaded_network_path = path;
+
+  return true;
+}
+
+const std::string& GetLoadedNetworkPath() {
+  return loaded_network_path;
+}
+
+void UseNodeNetwork(int node) {
+  UseNodeNetwork<MainArch>(node);
+#ifdef EVALFILE_SMALL
+  UseNodeNetwork<SmallArch>(node);
+#endif
+}
+
+Score Evaluate(Board &board, OutputTail tail) {
+  return Evaluate(board.GetAccumulator()->Main(), board.GetState(), tail);
+}
+
+#ifdef EVALFILE_SMALL
+Score EvaluateSmall(Board &board, OutputTail tail) {
+  return Evaluate(board.GetAccumulator()->Small(), board.GetState(), tail);
+}
+#endif
+
+std::vector<Score> EvaluateBatch(std::span<const BoardState> states,
+                                 OutputTail tail) {
+  constexpr std::size_t kChunkSize = kernels::kMaxBatchSize;
+
+  struct BatchEntry {
+    int bucket;
+    std::size_t index;
+  };
+
+  // Refreshing every position from the same accumulator lets the Finny table
+  // only apply the difference to the last position seen in each king bucket
+  thread_local auto accumulator =
+      std::make_unique<AccumulatorStack<MainArch>>();
+  // Only the activated feature layer of each position is kept around, rather
+  // than both of its accumulators
+  using ChunkActivations =
+      std::array<kernels::Activations<MainArch>, kChunkSize>;
+  alignas(simd::kAlignment) thread_local ChunkActivations activations;
+
+  std::vector<Score> scores(states.size());
+  std::array<BatchEntry, kChunkSize> chunk;
+  std::array<const kernels::Activations<MainArch>*, kChunkSize> group;
+  std::array<Score, kChunkSize> group_scores;
+
+  for (std::size_t start = 0; start < states.size(); start += kChunkSize) {
+    const std::size_t count = std::min(kChunkSize, states.size() - start);
+    for (std::size_t i = 0; i < count; i++) {
+      const auto& state = states[start + i];
+      accumulator->SetFromState(state, false);
+      kernels::ActivateFeatures<MainArch>(
+          (*accumulator)[state.turn].Data(),
+          (*accumulator)[FlipColor(state.turn)].Data(),
+          activations[i]);
+      chunk[i] = {accumulator->GetOutputBucket(state), i};
     }
-  }
 
-  // Forward 3rd layer neurons to output layer
-  constexpr int kResultChunks = 64 / sizeof(float);
-  std::array<float, kResultChunks> result_sums{};
+    // Each run of positions sharing an output bucket goes through L1-L3
+    // together, with every block of that bucket's weights loaded once per run
+    std::sort(chunk.begin(),
+              chunk.begin() + count,
+              [](const BatchEntry& a, const BatchEntry& b) {
+                return a.bucket < b.bucket;
+              });
+    const auto network = GetNetwork<MainArch>();
+    for (std::size_t first = 0; first < count;) {
+      std::size_t last = first;
+      while (last < count && chunk[last].bucket == chunk[first].bucket) {
+        group[last - first] = &activations[chunk[last].index];
+        last++;
+      }
 
-  for (int i = 0; i < arch::kL3Size; i += kResultChunks) {
-    for (int chunk = 0; chunk < kResultChunks; chunk++) {
-      const float activated = CReLU(l2_output[i + chunk]);
-      result_sums[chunk] = std::fma(activated,
-                                    network->l3_weights[bucket][i + chunk],
-                                    result_sums[chunk]);
+      kernels::ForwardBatch<MainArch>(*network,
+                                      group.data(),
+                                      static_cast<int>(last - first),
+                                      chunk[first].bucket,
+                                      tail,
+                                      group_scores.data());
+      for (std::size_t i = first; i < last; i++) {
+        scores[start + chunk[i].index] = group_scores[i - first];
+      }
+      first = last;
     }
   }
 
-  const float l3_output =
-      network->l3_biases[bucket] +
-      simd::ReduceAddPsRecursive(result_sums.data(), kResultChunks);
+  return scores;
+}
 
-  // Scale output
-  return static_cast<Score>(l3_output * arch::kEvalScale);
-#endif
+void CountActivations(std::span<const BoardState> states,
+                      ActivationStats<MainArch> &stats) {
+  thread_local auto accumulator =
+      std::make_unique<AccumulatorStack<MainArch>>();
+  for (const auto &state : states) {
+    accumulator->SetFromState(state, false);
+    for (const Color perspective : {Color::kWhite, Color::kBlack}) {
+      kernels::CountActivations<MainArch>((*accumulator)[perspective].Data(),
+                                          stats.counts.data());
+    }
+  }
+  stats.position_count += states.size();
 }
 
-}  // namespace nnue
\ No newline at end of file
+}  // namespace nnue
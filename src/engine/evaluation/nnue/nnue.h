@@ -1,6 +1,10 @@
 #ifndef INTEGRAL_NNUE_H
 #define INTEGRAL_NNUE_H
 
+#include <span>
+#include <string>
+#include <vector>
+
 #include "../../../../shared/multi_array.h"
 #include "../../../../shared/nnue/definitions.h"
 #include "../../../../shared/simd.h"
@@ -9,13 +13,67 @@
 
 namespace nnue {
 
-inline Network* network = nullptr;
+// The network of each architecture the engine evaluates with
+template <typename Arch>
+inline Network<Arch>* network = nullptr;
+
+// Bumped whenever a network is swapped, so that accumulators know to drop
+// anything they computed with the previous weights
+inline U32 network_version = 0;
+
+// A copy of the network local to the NUMA node this thread is bound to, if any
+template <typename Arch>
+inline thread_local Network<Arch>* node_network = nullptr;
+
+template <typename Arch>
+[[nodiscard]] Network<Arch>* GetNetwork() {
+  return node_network<Arch> ? node_network<Arch> : network<Arch>;
+}
 
 class Accumulator;
 
+// Loads the embedded networks, exiting if they don't match this build
 void LoadFromIncBin();
 
-Score Evaluate(Board& board);
+// Loads a network in the trainer's raw format (the same format as EVALFILE),
+// or one that preprocess wrote for this build, and swaps it in. Must only be
+// called between searches. Returns false and keeps the current network if
+// the file is invalid or of another architecture
+bool LoadFromFile(const std::string& path);
+
+// The path of the network that LoadFromFile loaded, or an empty string while
+// the embedded network is in use
+[[nodiscard]] const std::string& GetLoadedNetworkPath();
+
+// Makes the calling thread evaluate with copies of the networks that live on
+// the given NUMA node, or the shared networks if the node is negative
+void UseNodeNetwork(int node);
+
+#ifdef NNUE_INTEGER_TAIL
+constexpr OutputTail kDefaultOutputTail = OutputTail::kInteger;
+#else
+constexpr OutputTail kDefaultOutputTail = OutputTail::kFloat;
+#endif
+
+Score Evaluate(Board& board, OutputTail tail = kDefaultOutputTail);
+
+#ifdef EVALFILE_SMALL
+// Evaluates the position with the small network, which is only accurate enough
+// for positions that are clearly decided
+Score EvaluateSmall(Board& board, OutputTail tail = kDefaultOutputTail);
+#endif
+
+// Evaluates many unrelated positions, such as a dataset or every child of a
+// node, from the side to move's point of view. Accumulators are refreshed
+// against the Finny table rather than from scratch, and positions sharing an
+// output bucket run through L1-L3 together, loading each weight block once
+std::vector<Score> EvaluateBatch(std::span<const BoardState> states,
+                                 OutputTail tail = kDefaultOutputTail);
+
+// Adds how often the main network activates each pair of L1 neurons on the
+// given positions to stats, for preprocess --permute to order them by
+void CountActivations(std::span<const BoardState> states,
+                      ActivationStats<MainArch>& stats);
 
 }  // namespace nnue
 
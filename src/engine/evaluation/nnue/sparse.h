@@ -1,12 +1,11 @@
 #ifndef INTEGRAL_SPARSE_H
 #define INTEGRAL_SPARSE_H
 
-#include <fstream>
+#include <bit>
+#include <cstring>
 
 #include "../../../../shared/nnue/definitions.h"
-#include "../../../chess/bitboard.h"
 #include "../../../utils/types.h"
-#include "nnue.h"
 
 // #if BUILD_HAS_SIMD
 namespace nnue::sparse {
@@ -21,10 +20,8 @@ struct NnzEntry {
   for (I16 i = 0; i < 256; i++) {
     // Save the index of every set bit
     int num_bits = 0;
-    BitBoard bits = i;
-    while (bits) {
-      const int set_bit = bits.PopLsb();
-      table[i].indices[num_bits++] = set_bit;
+    for (unsigned bits = i; bits; bits &= bits - 1) {
+      table[i].indices[num_bits++] = std::countr_zero(bits);
     }
   }
   return table;
@@ -32,79 +29,247 @@ struct NnzEntry {
 
 alignas(simd::kAlignment) constexpr auto nnz_table = GenerateNnzTable();
 
-#ifdef SPARSE_PERMUTE
-//  This is the array where we keep track of the number of pair-wise activated
-//  neurons during a bench sequence, to be used for permuting the input and L1
-//  weights for maximizing sparse efficiency
-inline std::array<int, arch::kL1Size / 2> activations{};
+#if BUILD_HAS_SIMD
+inline namespace SIMD_TIER {
 
-static void CountActivations(
-    const std::array<U8, arch::kL1Size>& feature_output) {
-  for (int i = 0; i < arch::kL1Size; ++i) {
-    activations[i % activations.size()] += feature_output[i] > 0;
+// Indices of the groups of four L1 activations that have a non-zero element
+template <typename Arch>
+using NnzIndices = std::array<U16, Arch::kL1Size / 4>;
+
+// Each write below stores a full slice of indices past `count`, which never
+// overruns the array as `count` can't exceed the number of groups seen so far
+template <typename Arch>
+int FindNnzTable(const std::array<U8, Arch::kL1Size>& features,
+                 NnzIndices<Arch>& nnz_indices) {
+  constexpr int kI32ChunkSize = sizeof(simd::Vepi8) / sizeof(I32);
+
+  int nnz_count = 0;
+  auto nnz_base = _mm_setzero_si128();
+  const auto lookup_increment = _mm_set1_epi16(8);
+
+  for (int i = 0; i < Arch::kL1Size; i += sizeof(simd::Vepi8)) {
+    // Get a mask of all positive, non-zero elements
+    // Each bit in `nnz_mask` corresponds to whether a specific feature is
+    // positive (1) or zero (0)
+    const auto nnz_mask = simd::GetNnzMask(
+        *reinterpret_cast<const simd::Vepi8*>(&features[i]));
+
+    // Loop through 8-bit (U8) slices of this mask
+    for (int chunk = 0; chunk < kI32ChunkSize; chunk += 8) {
+      // Extract the 8-bit slice from the mask
+      const U8 slice = (nnz_mask >> chunk) & 0xFF;
+      // Lookup the relative indices for each set bit in the mask, essentially
+      // retrieving the indices for each positive element as an 8-element
+      // vector of I16s
+      const auto indices = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(&nnz_table[slice].indices));
+      // Store these absolute indices into our table. We account for the fact
+      // that they are relative indices (to this slice) by adding `nnz_base`,
+      // which will reflect the position each element is in the entire table
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(&nnz_indices[nnz_count]),
+                       _mm_add_epi16(nnz_base, indices));
+      // Update to reflect the total number of non-zero features processed
+      nnz_count += std::popcount(slice);
+      // Increment to reflect the starting index of the next slice
+      nnz_base = _mm_add_epi16(nnz_base, lookup_increment);
+    }
+  }
+
+  return nnz_count;
+}
+
+#if BUILD_HAS_AVX512VBMI2
+// Finds the indices of 32 groups at a time by compressing a vector of their
+// indices with the combined mask of two activation vectors, rather than
+// looking up every 8-bit slice of the mask in a table
+template <typename Arch>
+int FindNnzCompress(const std::array<U8, Arch::kL1Size>& features,
+                    NnzIndices<Arch>& nnz_indices) {
+  constexpr int kGroupsPerChunk = 32;
+  static_assert(Arch::kL1Size % (kGroupsPerChunk * 4) == 0);
+
+  alignas(64) static constexpr auto kGroupOffsets = [] {
+    std::array<U16, kGroupsPerChunk> offsets{};
+    for (int i = 0; i < kGroupsPerChunk; i++) offsets[i] = i;
+    return offsets;
+  }();
+
+  int nnz_count = 0;
+  auto nnz_base = _mm512_load_si512(kGroupOffsets.data());
+  const auto chunk_increment = _mm512_set1_epi16(kGroupsPerChunk);
+
+  for (int i = 0; i < Arch::kL1Size; i += kGroupsPerChunk * 4) {
+    const U32 nnz_mask =
+        simd::GetNnzMask(*reinterpret_cast<const simd::Vepi8*>(&features[i])) |
+        static_cast<U32>(simd::GetNnzMask(
+            *reinterpret_cast<const simd::Vepi8*>(&features[i + 64])))
+            << 16;
+
+    _mm512_storeu_si512(&nnz_indices[nnz_count],
+                        _mm512_maskz_compress_epi16(nnz_mask, nnz_base));
+    nnz_count += std::popcount(nnz_mask);
+    nnz_base = _mm512_add_epi16(nnz_base, chunk_increment);
   }
+
+  return nnz_count;
+}
+#endif
+
+// AVX-512 VNNI builds that can also compress 16-bit lanes take the wide path
+template <typename Arch>
+int FindNnz(const std::array<U8, Arch::kL1Size>& features,
+            NnzIndices<Arch>& nnz_indices) {
+#if BUILD_HAS_AVX512VNNI && BUILD_HAS_AVX512VBMI2
+  return FindNnzCompress<Arch>(features, nnz_indices);
+#else
+  return FindNnzTable<Arch>(features, nnz_indices);
+#endif
 }
 
-static void SavePermutedNetwork(std::string output) {
-  auto permuted_network = std::make_unique<RawNetwork>();
-  std::memcpy(permuted_network.get(), network, sizeof(RawNetwork));
+// Multiplies the non-zero groups of activations with the L1 weights, four,
+// two and then one group at a time
+template <typename Arch>
+void PropagateL1x4(const Network<Arch>& network,
+                   int bucket,
+                   const std::array<U8, Arch::kL1Size>& features,
+                   const NnzIndices<Arch>& nnz_indices,
+                   int nnz_count,
+                   std::array<I32, Arch::kL2Size>& l1_sums) {
+  constexpr int kI32ChunkSize = sizeof(simd::Vepi32) / sizeof(I32);
+  const U8* feature_output = features.data();
 
-  std::array<int, arch::kL1Size / 2> sorted_neurons;
-  // Each neuron is at its own index initially (of course)
-  for (int i = 0; i < sorted_neurons.size(); i++) {
-    sorted_neurons[i] = i;
+  int i = 0;
+  // Process 4 features at a time
+  for (; i < nnz_count - 3; i += 4) {
+    const int idx0 = nnz_indices[i] * 4;
+    const int idx1 = nnz_indices[i + 1] * 4;
+    const int idx2 = nnz_indices[i + 2] * 4;
+    const int idx3 = nnz_indices[i + 3] * 4;
+
+    // Load 4 feature values
+    const auto feature0 =
+        simd::SetEpi32(*reinterpret_cast<const I32*>(&feature_output[idx0]));
+    const auto feature1 =
+        simd::SetEpi32(*reinterpret_cast<const I32*>(&feature_output[idx1]));
+    const auto feature2 =
+        simd::SetEpi32(*reinterpret_cast<const I32*>(&feature_output[idx2]));
+    const auto feature3 =
+        simd::SetEpi32(*reinterpret_cast<const I32*>(&feature_output[idx3]));
+
+    // Process weights with unrolled loop
+    for (int j = 0; j < Arch::kL2Size; j += kI32ChunkSize) {
+      const auto weight0 = *reinterpret_cast<const simd::Vepi8*>(
+          &network.l1_weights[bucket][idx0 + j / 4]);
+      const auto weight1 = *reinterpret_cast<const simd::Vepi8*>(
+          &network.l1_weights[bucket][idx1 + j / 4]);
+      const auto weight2 = *reinterpret_cast<const simd::Vepi8*>(
+          &network.l1_weights[bucket][idx2 + j / 4]);
+      const auto weight3 = *reinterpret_cast<const simd::Vepi8*>(
+          &network.l1_weights[bucket][idx3 + j / 4]);
+
+      auto& sums = *reinterpret_cast<simd::Vepi32*>(&l1_sums[j]);
+      sums = simd::DpbusdEpi32x2(sums, feature0, weight0, feature1, weight1);
+      sums = simd::DpbusdEpi32x2(sums, feature2, weight2, feature3, weight3);
+    }
   }
 
-  // Sort based on activations
-  std::ranges::stable_sort(sorted_neurons, [&](const int& a, const int& b) {
-    return activations[a] > activations[b];
-  });
-
-  // Permute all weight/biases for neuron pairs
-  for (int i = 0; i < sorted_neurons.size(); i++) {
-    const int idx = sorted_neurons[i];
-
-    // Feature biases
-    permuted_network->feature_biases[i] = network->feature_biases[idx];
-    permuted_network->feature_biases[i + arch::kL1Size / 2] =
-        network->feature_biases[idx + arch::kL1Size / 2];
-
-    // Feature weights
-    for (int bucket = 0; bucket < arch::kInputBucketCount; ++bucket) {
-      for (int side = 0; side <= 1; ++side) {
-        for (int piece = 0; piece < kNumPieceTypes; ++piece) {
-          for (int square = 0; square < kSquareCount; ++square) {
-            permuted_network->feature_weights[bucket][side][piece][square][i] =
-                network->feature_weights[bucket][side][piece][square][idx];
-            permuted_network->feature_weights[bucket][side][piece][square]
-                                             [i + arch::kL1Size / 2] =
-                network->feature_weights[bucket][side][piece][square]
-                                        [idx + arch::kL1Size / 2];
-          }
-        }
-      }
+  // Process 2 features at a time
+  for (; i < nnz_count - 1; i += 2) {
+    const int idx = nnz_indices[i] * 4, idx_two = nnz_indices[i + 1] * 4;
+    const auto feature_vector =
+        simd::SetEpi32(*reinterpret_cast<const I32*>(&feature_output[idx]));
+    const auto feature_vector_two =
+        simd::SetEpi32(*reinterpret_cast<const I32*>(&feature_output[idx_two]));
+    for (int j = 0; j < Arch::kL2Size; j += kI32ChunkSize) {
+      const auto weight_vector = *reinterpret_cast<const simd::Vepi8*>(
+          &network.l1_weights[bucket][idx + j / 4]);
+      const auto weight_vector_two = *reinterpret_cast<const simd::Vepi8*>(
+          &network.l1_weights[bucket][idx_two + j / 4]);
+      auto& sums = *reinterpret_cast<simd::Vepi32*>(&l1_sums[j]);
+      sums = simd::DpbusdEpi32x2(sums,
+                                 feature_vector,
+                                 weight_vector,
+                                 feature_vector_two,
+                                 weight_vector_two);
     }
+  }
+
+  // Handle the remaining features
+  for (; i < nnz_count; i++) {
+    const int idx = nnz_indices[i] * 4;
+    const auto feature_vector =
+        simd::SetEpi32(*reinterpret_cast<const I32*>(&feature_output[idx]));
+    for (int j = 0; j < Arch::kL2Size; j += kI32ChunkSize) {
+      const auto weight_vector = *reinterpret_cast<const simd::Vepi8*>(
+          &network.l1_weights[bucket][idx + j / 4]);
+      auto& sums = *reinterpret_cast<simd::Vepi32*>(&l1_sums[j]);
+      sums = simd::DpbusdEpi32(sums, feature_vector, weight_vector);
+    }
+  }
+}
 
-    // L1 Weights
-    for (int bucket = 0; bucket < arch::kOutputBucketCount; ++bucket) {
-      for (int j = 0; j < arch::kL2Size; ++j) {
-        permuted_network->l1_weights[bucket][j][i] =
-            network->l1_weights[bucket][j][idx];
-        permuted_network->l1_weights[bucket][j][i + arch::kL1Size / 2] =
-            network->l1_weights[bucket][j][idx + arch::kL1Size / 2];
-      }
+#if BUILD_HAS_AVX512VNNI
+// With AVX-512 all 16 L2 sums fit in one register, so eight groups are
+// accumulated per iteration with native VNNI dot products, alternating
+// between two registers to halve the dependency chain. Activations never
+// exceed 127, so this matches the saturating emulation bit for bit
+template <typename Arch>
+void PropagateL1x8(const Network<Arch>& network,
+                   int bucket,
+                   const std::array<U8, Arch::kL1Size>& features,
+                   const NnzIndices<Arch>& nnz_indices,
+                   int nnz_count,
+                   std::array<I32, Arch::kL2Size>& l1_sums) {
+  static_assert(Arch::kL2Size * sizeof(I32) == sizeof(simd::Vepi32));
+
+  const auto group_vector = [&](int i) {
+    I32 group;
+    std::memcpy(&group, &features[nnz_indices[i] * 4], sizeof(group));
+    return _mm512_set1_epi32(group);
+  };
+  const auto weight_vector = [&](int i) {
+    return _mm512_load_si512(&network.l1_weights[bucket][nnz_indices[i] * 4]);
+  };
+
+  auto sums = simd::LoadEpi32(l1_sums.data());
+  auto sums_two = _mm512_setzero_si512();
+
+  int i = 0;
+  for (; i + 8 <= nnz_count; i += 8) {
+    for (int k = 0; k < 8; k += 2) {
+      sums = _mm512_dpbusd_epi32(sums, group_vector(i + k), weight_vector(i + k));
+      sums_two = _mm512_dpbusd_epi32(
+          sums_two, group_vector(i + k + 1), weight_vector(i + k + 1));
     }
   }
 
-  std::ofstream output_stream(output, std::ios::binary);
-  output_stream.write(reinterpret_cast<char*>(permuted_network.get()),
-                      sizeof(Network));
-  output_stream.close();
+  for (; i < nnz_count; i++) {
+    sums = _mm512_dpbusd_epi32(sums, group_vector(i), weight_vector(i));
+  }
 
-  fmt::println("Permuted network written to {}", output);
+  simd::StoreEpi32(l1_sums.data(), _mm512_add_epi32(sums, sums_two));
 }
 #endif
 
+template <typename Arch>
+void PropagateL1(const Network<Arch>& network,
+                 int bucket,
+                 const std::array<U8, Arch::kL1Size>& features,
+                 const NnzIndices<Arch>& nnz_indices,
+                 int nnz_count,
+                 std::array<I32, Arch::kL2Size>& l1_sums) {
+#if BUILD_HAS_AVX512VNNI && BUILD_HAS_AVX512VBMI2
+  PropagateL1x8<Arch>(
+      network, bucket, features, nnz_indices, nnz_count, l1_sums);
+#else
+  PropagateL1x4<Arch>(
+      network, bucket, features, nnz_indices, nnz_count, l1_sums);
+#endif
+}
+
+}  // namespace SIMD_TIER
+#endif
+
 }  // namespace nnue::sparse
 // #endif
 
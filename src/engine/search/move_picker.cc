@@ -36,7 +36,8 @@ MovePicker::MovePicker(MovePickerType type,
                        Move tt_move,
                        history::History &history,
                        StackEntry *stack,
-                       int see_threshold)
+                       int see_threshold,
+                       TranspositionTable *prefetch_table)
     : board_(board),
       tt_move_(tt_move),
       type_(type),
@@ -44,7 +45,9 @@ MovePicker::MovePicker(MovePickerType type,
       stack_(stack),
       stage_(Stage::kTTMove),
       moves_idx_(0),
-      see_threshold_(see_threshold) {}
+      selected_idx_(0),
+      see_threshold_(see_threshold),
+      prefetch_table_(prefetch_table) {}
 
 Move MovePicker::Next() {
   const auto &state = board_.GetState();
@@ -67,7 +70,7 @@ Move MovePicker::Next() {
 
   if (stage_ == Stage::kGoodNoisys) {
     while (moves_idx_ < noisys_.Size()) {
-      const auto move = SelectionSort(noisys_, moves_idx_);
+      const auto move = SelectAndPrefetch(noisys_, moves_idx_);
       const auto score = noisys_[moves_idx_].score;
       const auto history_score = history_.GetCaptureMoveScore(state, move);
 
@@ -118,12 +121,13 @@ Move MovePicker::Next() {
   if (stage_ == Stage::kGenerateQuiets) {
     stage_ = Stage::kQuiets;
     moves_idx_ = 0;
+    selected_idx_ = 0;
     GenerateAndScoreMoves<MoveGenType::kQuiet>(quiets_);
   }
 
   if (stage_ == Stage::kQuiets) {
     if (moves_idx_ < quiets_.Size()) {
-      return SelectionSort(quiets_, moves_idx_++);
+      return SelectAndPrefetch(quiets_, moves_idx_++);
     }
 
     stage_ = Stage::kBadNoisys;
@@ -193,6 +197,25 @@ Move &MovePicker::SelectionSort(List<ScoredMove, kMaxMoves> &move_list,
   return move_list[index].move;
 }
 
+Move &MovePicker::SelectAndPrefetch(List<ScoredMove, kMaxMoves> &move_list,
+                                    int index) {
+  if (selected_idx_ <= index) {
+    SelectionSort(move_list, index);
+    selected_idx_ = index + 1;
+  }
+
+  if (prefetch_table_) {
+    const int end =
+        std::min(index + 1 + tt_prefetch_distance, move_list.Size());
+    for (; selected_idx_ < end; selected_idx_++) {
+      const auto move = SelectionSort(move_list, selected_idx_);
+      prefetch_table_->Prefetch(board_.PredictKeyAfter(move));
+    }
+  }
+
+  return move_list[index].move;
+}
+
 template <MoveGenType move_type>
 void MovePicker::GenerateAndScoreMoves(List<ScoredMove, kMaxMoves> &list) {
   const auto &state = board_.GetState();
@@ -7,9 +7,15 @@
 #include "../../chess/move_gen.h"
 #include "../evaluation/evaluation.h"
 #include "history/history.h"
+#include "transpo.h"
 
 namespace search {
 
+// How many of the upcoming moves of a scored list have their TT clusters
+// prefetched whenever a move is handed out, so that the memory latency is
+// hidden behind the search of the current move. Zero disables the lookahead
+inline int tt_prefetch_distance = 2;
+
 struct ScoredMove {
   Move move;
   int score;
@@ -39,7 +45,8 @@ class MovePicker {
              Move tt_move,
              history::History &history,
              StackEntry *stack,
-             int see_threshold = 0);
+             int see_threshold = 0,
+             TranspositionTable *prefetch_table = nullptr);
 
   Move Next();
 
@@ -52,6 +59,11 @@ class MovePicker {
  private:
   Move &SelectionSort(List<ScoredMove, kMaxMoves> &move_list, int index);
 
+  // Selects the move at the index along with the next few moves ahead of
+  // time, prefetching the TT clusters of the ones selected early. The order is
+  // identical to selecting each move lazily
+  Move &SelectAndPrefetch(List<ScoredMove, kMaxMoves> &move_list, int index);
+
   template <MoveGenType move_type>
   void GenerateAndScoreMoves(List<ScoredMove, kMaxMoves> &list);
 
@@ -67,7 +79,10 @@ class MovePicker {
   List<ScoredMove, kMaxMoves> noisys_, bad_noisys_;
   List<ScoredMove, kMaxMoves> quiets_;
   int moves_idx_;
+  // Moves of the current list before this index have already been selected
+  int selected_idx_;
   int see_threshold_;
+  TranspositionTable *prefetch_table_;
   
   // Pre-calculated threat maps
   BitBoard pawn_threats_;
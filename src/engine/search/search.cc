@@ -5,7 +5,9 @@
 #include <thread>
 
 #include "../../data_gen/data_gen.h"
+#include "../../utils/numa.h"
 #include "../evaluation/evaluation.h"
+#include "../evaluation/nnue/nnue.h"
 #include "../uci/reporter.h"
 #include "constants.h"
 #include "fmt/format.h"
@@ -54,7 +56,8 @@ Searcher::Searcher(Board &board)
       start_barrier_(2),
       search_end_barrier_(1),
       next_thread_id_(0),
-      searching_threads_(0) {}
+      searching_threads_(0),
+      eval_cache_mb_size_(eval::kDefaultEvalCacheMbSize) {}
 
 Searcher::~Searcher() {
   if (!quit_.load(std::memory_order_acquire)) {
@@ -66,6 +69,11 @@ template <SearchType type>
 void Searcher::IterativeDeepening(Thread &thread) {
   constexpr bool regular_search = type == SearchType::kRegular;
 
+  if constexpr (kTrackTTStats) {
+    tt_stats = &thread.tt_stats;
+  }
+  UseEvalCache(thread);
+
   const auto root_stack = &thread.stack.Front();
   thread.root_moves = RootMoveList(thread.board);
 
@@ -73,6 +81,8 @@ void Searcher::IterativeDeepening(Thread &thread) {
       std::min(uci::listener.GetOption("MultiPV").GetValue<int>(),
                thread.root_moves.Size());
   const bool minimal = uci::listener.GetOption("Minimal").GetValue<bool>();
+  const std::size_t hash_full_samples =
+      uci::listener.GetOption("HashFullSamples").GetValue<int>();
 
   std::unique_ptr<uci::reporter::ReportInfo> report_info;
   if (thread.IsMainThread()) {
@@ -152,6 +162,7 @@ void Searcher::IterativeDeepening(Thread &thread) {
 
     if (regular_search && (!minimal || soft_timeout) && thread.IsMainThread() &&
         !hard_timeout) {
+      const int hash_full = transposition_table_.HashFull(hash_full_samples);
       for (int i = 0; i < multi_pv; ++i) {
         auto &pv_move = thread.root_moves[i];
 
@@ -166,7 +177,7 @@ void Searcher::IterativeDeepening(Thread &thread) {
             nodes_searched,
             time_mgmt_.TimeElapsed(),
             nodes_searched * 1000 / time_mgmt_.TimeElapsed(),
-            transposition_table_.HashFull(),
+            hash_full,
             syzygy::enabled,
             GetTbHits(),
             pv_move.pv.UCIFormat(),
@@ -206,6 +217,8 @@ void Searcher::IterativeDeepening(Thread &thread) {
 
     // Age the transposition table to recognize TT entries from past searches
     transposition_table_.Age();
+    // Every search thread has stopped, so stale clusters can be swept again
+    transposition_table_.ResumeSweeper();
 
     if (regular_search) {
       fmt::println(
@@ -215,6 +228,28 @@ void Searcher::IterativeDeepening(Thread &thread) {
   } else {
     SendStoppedSignal();
   }
+
+  // Bench and datagen threads are freed while this OS thread lives on
+  eval::eval_cache = nullptr;
+  eval::eval_cache_stats = nullptr;
+}
+
+void Searcher::UseEvalCache(Thread &thread) {
+  if (shared_eval_cache_) {
+    eval::eval_cache = shared_eval_cache_.get();
+  } else {
+    // Allocating the cache on the thread that uses it places its pages on the
+    // thread's NUMA node
+    auto &cache = thread.eval_cache;
+    if (!cache || cache->GetMbSize() != eval_cache_mb_size_) {
+      cache.reset();
+      cache = std::make_unique<eval::EvalCache>();
+      cache->Resize(eval_cache_mb_size_);
+      cache->Clear();
+    }
+    eval::eval_cache = cache.get();
+  }
+  eval::eval_cache_stats = &thread.eval_cache_stats;
 }
 
 [[nodiscard]] Score AdjustStaticEval(Score static_eval,
@@ -282,6 +317,10 @@ Score Searcher::QuiescentSearch(Thread &thread,
     tt_was_in_pv |= tt_entry->was_in_pv;
     tt_move = tt_entry->move;
     tt_static_eval = tt_entry->static_eval;
+
+    if constexpr (kTrackTTStats) {
+      tt_stats->collisions += tt_move && !board.IsMovePseudoLegal(tt_move);
+    }
   }
 
   // Use the TT entry's evaluation if possible
@@ -290,6 +329,9 @@ Score Searcher::QuiescentSearch(Thread &thread,
   // Saved scores from non-PV nodes must fall within the current alpha/beta
   // window to allow early cutoff
   if (!in_pv_node && can_use_tt_eval && tt_entry->depth >= tt_depth) {
+    if constexpr (kTrackTTStats) {
+      ++tt_stats->cutoffs;
+    }
     return TranspositionTableEntry::CorrectScore(tt_entry->score, stack->ply);
   }
 
@@ -349,8 +391,13 @@ Score Searcher::QuiescentSearch(Thread &thread,
   MoveList quiets, captures;
   Move best_move = Move::NullMove();
 
-  MovePicker move_picker(
-      MovePickerType::kQuiescence, board, tt_move, history, stack);
+  MovePicker move_picker(MovePickerType::kQuiescence,
+                         board,
+                         tt_move,
+                         history,
+                         stack,
+                         0,
+                         &transposition_table_);
   while (const auto move = move_picker.Next()) {
     // Stop searching since all the good noisy moves have been searched,
     // unless we need to find a quiet evasion
@@ -572,6 +619,10 @@ Score Searcher::PVSearch(Thread &thread,
     tt_was_in_pv |= tt_entry->was_in_pv;
     tt_move = tt_entry->move;
     tt_static_eval = tt_entry->static_eval;
+
+    if constexpr (kTrackTTStats) {
+      tt_stats->collisions += tt_move && !board.IsMovePseudoLegal(tt_move);
+    }
   }
 
   if (in_root) {
@@ -583,6 +634,9 @@ Score Searcher::PVSearch(Thread &thread,
   if (!stack->excluded_tt_move && !in_pv_node && can_use_tt_eval &&
       (cut_node || tt_entry->score <= alpha) &&
       tt_entry->depth > depth - (tt_entry->score <= beta)) {
+    if constexpr (kTrackTTStats) {
+      ++tt_stats->cutoffs;
+    }
     return TranspositionTableEntry::CorrectScore(tt_entry->score, stack->ply);
   }
 
@@ -881,8 +935,13 @@ Score Searcher::PVSearch(Thread &thread,
   Score best_score = kScoreNone;
   Move best_move = Move::NullMove();
 
-  MovePicker move_picker(
-      MovePickerType::kSearch, board, tt_move, history, stack);
+  MovePicker move_picker(MovePickerType::kSearch,
+                         board,
+                         tt_move,
+                         history,
+                         stack,
+                         0,
+                         &transposition_table_);
   while (const auto move = move_picker.Next()) {
     if (in_root && !thread.root_moves.MoveExists(move, thread.pv_move_idx)) {
       continue;
@@ -1349,10 +1408,49 @@ void Searcher::SetThreadCount(U16 count) {
   for (U16 i = 0; i < count; i++) {
     auto &thread =
         threads_.emplace_back(std::make_unique<Thread>(next_thread_id_++));
-    thread->raw_thread = std::thread([this, &thread]() { Run(*thread); });
+    thread->raw_thread = std::thread([this, &thread]() {
+      // Keep each thread and the network weights it reads on the same node
+      const int node = numa::NodeForThread(thread->id);
+      nnue::UseNodeNetwork(numa::BindCurrentThread(node) ? node : -1);
+      Run(*thread);
+    });
+  }
+}
+
+void Searcher::RespawnThreads() {
+  if (!threads_.empty()) {
+    const auto thread_count = threads_.size();
+    QuitThreads();
+    threads_.clear();
+    SetThreadCount(thread_count);
   }
 }
 
+void Searcher::NetworkChanged() {
+  // The threads' per-node network copies were made from the old network
+  if (numa::IsActive()) {
+    RespawnThreads();
+  }
+
+  // Cached evaluations and TT static evals came from the old network
+  NewGame();
+  board_.GetAccumulator()->SetFromState(board_.GetState());
+}
+
+void Searcher::SetNumaPolicy(numa::Policy policy) {
+  if (numa::policy == policy) {
+    return;
+  }
+
+  numa::policy = policy;
+
+  // Respawn the search threads so that they get (un)bound from their nodes
+  RespawnThreads();
+
+  // Reallocate the table so that its pages are placed under the new policy
+  ResizeHash(transposition_table_.GetMbSize());
+}
+
 void Searcher::Start(TimeConfig time_config) {
   if (searching_threads_.load() > 0) {
     return;
@@ -1365,6 +1463,7 @@ void Searcher::Start(TimeConfig time_config) {
   time_mgmt_.SetConfig(time_config);
   time_mgmt_.Start();
 
+  transposition_table_.PauseSweeper();
   searching_threads_.store(static_cast<U16>(threads_.size()),
                            std::memory_order_seq_cst);
   for (auto &thread : threads_) {
@@ -1383,6 +1482,7 @@ std::pair<Score, Move> Searcher::DataGenStart(std::unique_ptr<Thread> &thread,
   // The thread's board gets directly modified, so we don't need to call
   // SetBoard
   thread->Reset();
+  transposition_table_.PauseSweeper();
 
   time_mgmt_.SetConfig(time_config);
   time_mgmt_.Start();
@@ -1401,6 +1501,7 @@ U64 Searcher::Bench(std::unique_ptr<Thread> &thread, int depth) {
 
   thread->Reset();
   thread->SetBoard(board_);
+  transposition_table_.PauseSweeper();
 
   TimeConfig config{.depth = depth};
   time_mgmt_.SetConfig(config);
@@ -1417,12 +1518,13 @@ void Searcher::Stop() {
 
 void Searcher::NewGame(bool clear_tables) {
   if (clear_tables) {
-    transposition_table_.Clear(std::max<int>(1, threads_.size()));
+    transposition_table_.NewGeneration();
+  }
+
+  if (shared_eval_cache_) {
+    shared_eval_cache_->NewGeneration();
   }
 
-  // Clear evaluation cache for all threads
-  eval::ClearEvalCache();
-  
   for (auto &thread : threads_) {
     thread->NewGame();
   }
@@ -1453,4 +1555,91 @@ void Searcher::ResizeHash(U64 size) {
   transposition_table_.Clear(std::max<int>(1, threads_.size()));
 }
 
+bool Searcher::SetSharedHash(const std::string &name) {
+  if (transposition_table_.SetSharedName(name)) {
+    ResizeHash(transposition_table_.GetMbSize());
+  }
+  return name.empty() || transposition_table_.IsShared();
+}
+
+void Searcher::FreeHash() {
+  Stop();
+  transposition_table_.Free();
+}
+
+TranspositionTableStats Searcher::GetTTStats() const {
+  TranspositionTableStats total;
+  for (const auto &thread : threads_) {
+    total += thread->tt_stats;
+  }
+  return total;
+}
+
+void Searcher::ResizeEvalCache(std::size_t mb_size) {
+  eval_cache_mb_size_ = mb_size;
+  // Private caches are resized by their threads before they next search
+  if (shared_eval_cache_) {
+    shared_eval_cache_->Resize(mb_size);
+    shared_eval_cache_->Clear();
+  }
+}
+
+void Searcher::SetSharedEvalCache(bool shared) {
+  if (shared == static_cast<bool>(shared_eval_cache_)) {
+    return;
+  }
+
+  if (shared) {
+    shared_eval_cache_ = std::make_unique<eval::EvalCache>();
+    shared_eval_cache_->Resize(eval_cache_mb_size_);
+    shared_eval_cache_->Clear();
+  } else {
+    shared_eval_cache_.reset();
+  }
+
+  // Only one kind of cache is in use at a time
+  for (auto &thread : threads_) {
+    thread->eval_cache.reset();
+  }
+}
+
+eval::EvalCacheStats Searcher::GetEvalCacheStats() const {
+  eval::EvalCacheStats total;
+  for (const auto &thread : threads_) {
+    total += thread->eval_cache_stats;
+  }
+  return total;
+}
+
+TranspositionTableOccupancy Searcher::GetHashOccupancy(
+    std::size_t samples) const {
+  return transposition_table_.GetOccupancy(samples);
+}
+
+PageKind Searcher::GetHashPageKind() const {
+  return transposition_table_.GetPageKind();
+}
+
+std::size_t Searcher::GetHashMbSize() const {
+  return transposition_table_.GetMbSize();
+}
+
+bool Searcher::SaveHash(const std::string &path) {
+  if (searching_threads_.load() > 0) {
+    fmt::println("Error: cannot save the hash while searching");
+    return false;
+  }
+  return transposition_table_.SaveToFile(path,
+                                         std::max<int>(1, threads_.size()));
+}
+
+bool Searcher::LoadHash(const std::string &path) {
+  if (searching_threads_.load() > 0) {
+    fmt::println("Error: cannot load the hash while searching");
+    return false;
+  }
+  return transposition_table_.LoadFromFile(path,
+                                           std::max<int>(1, threads_.size()));
+}
+
 }  // namespace search
@@ -5,6 +5,8 @@
 
 #include "../../chess/move_gen.h"
 #include "../../utils/barrier.h"
+#include "../../utils/numa.h"
+#include "../evaluation/eval_cache.h"
 #include "../evaluation/evaluation.h"
 #include "../evaluation/nnue/accumulator.h"
 #include "history/history.h"
@@ -116,15 +118,19 @@ struct alignas(64) Thread {
     history.Clear();
     stack.Reset();
     previous_score = kScoreNone;
+    tt_stats = {};
+    if (eval_cache) eval_cache->NewGeneration();
+    eval_cache_stats = {};
   }
 
   [[nodiscard]] bool IsMainThread() const {
     return id == 0;
   }
 
+  // The accumulators are updated from the previous search's root, which the
+  // new root is usually only a move or two away from
   void SetBoard(Board &new_board) {
-    board = new_board;
-    board.GetAccumulator()->SetFromState(board.GetState());
+    board.SetPositionKeepingAccumulator(new_board);
   }
 
   void Reset() {
@@ -153,6 +159,14 @@ struct alignas(64) Thread {
   U16 nmp_min_ply;
   int pv_move_idx;
   
+  // Only updated in builds with TT_STATS enabled
+  TranspositionTableStats tt_stats;
+
+  // Allocated by the thread itself when it first searches, unless the
+  // searcher's shared evaluation cache is in use
+  std::unique_ptr<eval::EvalCache> eval_cache;
+  eval::EvalCacheStats eval_cache_stats;
+
   // Root move data - accessed less frequently
   alignas(64) RootMoveList root_moves;  // Separate cache line
   
@@ -181,6 +195,12 @@ class Searcher {
 
   void SetThreadCount(U16 count);
 
+  void SetNumaPolicy(numa::Policy policy);
+
+  // Drops everything derived from the previous network after nnue::network is
+  // swapped
+  void NetworkChanged();
+
   void QuitThreads();
 
   void NewGame(bool clear_tables = true);
@@ -193,11 +213,51 @@ class Searcher {
 
   void ResizeHash(U64 size);
 
+  // Moves the hash into the named shared memory segment, or back into private
+  // memory for an empty name. Returns false if the segment couldn't be attached
+  bool SetSharedHash(const std::string &name);
+
+  // Stops searching and releases the hash before the process exits, since
+  // exit() skips the destructor that detaches from a shared hash
+  void FreeHash();
+
+  // Sums the TT counters of every search thread since the last ucinewgame
+  [[nodiscard]] TranspositionTableStats GetTTStats() const;
+
+  // Sizes the evaluation cache of each search thread, or the one they share
+  void ResizeEvalCache(std::size_t mb_size);
+
+  // Makes the search threads share a single evaluation cache, or go back to
+  // one each
+  void SetSharedEvalCache(bool shared);
+
+  // Sums the evaluation cache counters of every search thread since the last
+  // ucinewgame
+  [[nodiscard]] eval::EvalCacheStats GetEvalCacheStats() const;
+
+  [[nodiscard]] TranspositionTableOccupancy GetHashOccupancy(
+      std::size_t samples) const;
+
+  [[nodiscard]] PageKind GetHashPageKind() const;
+
+  [[nodiscard]] std::size_t GetHashMbSize() const;
+
+  bool SaveHash(const std::string &path);
+
+  bool LoadHash(const std::string &path);
+
  private:
   void Run(Thread &thread);
 
   void WaitForThreads();
 
+  // Restarts the search threads, keeping the same count
+  void RespawnThreads();
+
+  // Points the calling OS thread's evaluation cache at the one the thread
+  // should use, sizing its private cache first if needed
+  void UseEvalCache(Thread &thread);
+
   template <SearchType type>
   void IterativeDeepening(Thread &thread);
 
@@ -227,6 +287,8 @@ class Searcher {
   std::condition_variable thread_stopped_signal_;
   std::vector<std::unique_ptr<Thread>> threads_;
   TranspositionTable transposition_table_;
+  std::size_t eval_cache_mb_size_;
+  std::unique_ptr<eval::EvalCache> shared_eval_cache_;
 };
 
 }  // namespace search
@@ -1,27 +1,81 @@
 #include "transpo.h"
 
+#include <filesystem>
+#include <fstream>
 #include <thread>
 
+#include "../../utils/numa.h"
 #include "../evaluation/evaluation.h"
+#include "fmt/format.h"
 
 namespace search {
 
-[[nodiscard]] TranspositionTableEntry *TranspositionTable::Probe(
+template <typename Cluster>
+BasicTranspositionTable<Cluster>::~BasicTranspositionTable() {
+  PauseSweeper();
+}
+
+template <typename Cluster>
+void BasicTranspositionTable<Cluster>::Resize(std::size_t mb_size) {
+  PauseSweeper();
+  AlignedHashTable<Cluster>::Resize(mb_size);
+  AttachState();
+  sweep_cursor_ = 0;
+  sweep_remaining_ = 0;
+  // This must happen before the table is first touched by Clear()
+  numa::InterleavePages(table_, table_size_ * sizeof(Cluster));
+}
+
+template <typename Cluster>
+bool BasicTranspositionTable<Cluster>::SetSharedName(const std::string &name) {
+  // The layout is part of the segment name so that builds with different
+  // layouts never index into each other's tables
+  const auto segment_name =
+      name.empty() ? std::string()
+                   : fmt::format("/{}-{}-{}",
+                                 name,
+                                 sizeof(Cluster),
+                                 sizeof(TranspositionTableKey) * 8);
+  if (segment_name == this->GetSharedName()) {
+    return false;
+  }
+
+  AlignedHashTable<Cluster>::SetSharedName(segment_name);
+  return true;
+}
+
+template <typename Cluster>
+[[nodiscard]] TranspositionTableEntry *BasicTranspositionTable<Cluster>::Probe(
     const U64 &key) {
   auto &cluster = (*this)[key];
-  const U16 key16 = static_cast<U16>(key);
+  const auto stored_key = static_cast<TranspositionTableKey>(key);
+
+  if constexpr (kTrackTTStats) {
+    ++tt_stats->probes;
+  }
+
+  // Clusters from a previous generation are stale, so treat them as empty
+  const U16 generation = GetGeneration();
+  if (cluster.generation != generation) {
+    cluster.entries = {};
+    cluster.generation = generation;
+    return &cluster.entries[0];
+  }
   
   // Pre-calculate quality scores for all entries
-  int qualities[kTTClusterSize];
+  int qualities[Cluster::kEntryCount];
   int min_quality = INT_MAX;
   int min_quality_idx = 0;
   
   // First pass: find exact match or empty slot, calculate qualities
-  for (int i = 0; i < kTTClusterSize; i++) {
+  for (int i = 0; i < Cluster::kEntryCount; i++) {
     const auto entry = &cluster.entries[i];
     
     // Fast path: exact key match or empty slot
-    if (entry->key == 0 || entry->key == key16) {
+    if (entry->key == 0 || entry->key == stored_key) {
+      if constexpr (kTrackTTStats) {
+        tt_stats->hits += entry->key == stored_key;
+      }
       return entry;
     }
     
@@ -37,22 +91,42 @@ namespace search {
   return &cluster.entries[min_quality_idx];
 }
 
-void TranspositionTable::Save(TranspositionTableEntry *old_entry,
-                              TranspositionTableEntry new_entry,
-                              const U64 &key,
-                              I32 ply,
-                              bool in_pv) {
+template <typename Cluster>
+void BasicTranspositionTable<Cluster>::Save(
+    TranspositionTableEntry *old_entry,
+    TranspositionTableEntry new_entry,
+    const U64 &key,
+    I32 ply,
+    bool in_pv) {
+  if constexpr (kTrackTTStats) {
+    ++tt_stats->saves;
+  }
+
   if (new_entry.move || !old_entry->CompareKey(key)) {
     old_entry->move = new_entry.move;
   }
 
+  const int age = GetAge();
   if (!old_entry->CompareKey(key) ||
       new_entry.flag == TranspositionTableEntry::kExact ||
       new_entry.depth + 3 + 2 * in_pv >= old_entry->depth ||
-      old_entry->age != age_) {
-    new_entry.age = age_;
+      old_entry->age != age) {
+    if constexpr (kTrackTTStats) {
+      if (old_entry->key == 0) {
+        ++tt_stats->empty_replacements;
+      } else if (!old_entry->CompareKey(key)) {
+        ++tt_stats->key_replacements;
+      } else if (new_entry.flag == TranspositionTableEntry::kExact ||
+                 new_entry.depth + 3 + 2 * in_pv >= old_entry->depth) {
+        ++tt_stats->depth_replacements;
+      } else {
+        ++tt_stats->age_replacements;
+      }
+    }
 
-    old_entry->key = static_cast<U16>(key);
+    new_entry.age = age;
+
+    old_entry->key = static_cast<TranspositionTableKey>(key);
     old_entry->score =
         TranspositionTableEntry::CorrectScore(new_entry.score, -ply);
     old_entry->depth = new_entry.depth;
@@ -63,46 +137,404 @@ void TranspositionTable::Save(TranspositionTableEntry *old_entry,
   }
 }
 
-U32 TranspositionTable::GetAgeDelta(
+template <typename Cluster>
+U32 BasicTranspositionTable<Cluster>::GetAgeDelta(
     const TranspositionTableEntry *entry) const {
-  return (kMaxTTAge + age_ - entry->age) % kMaxTTAge;
+  return (kMaxTTAge + GetAge() - entry->age) % kMaxTTAge;
+}
+
+template <typename Cluster>
+void BasicTranspositionTable<Cluster>::Age() {
+  int new_age = 0;
+  UpdateState([this, &new_age](int age, U16 generation) {
+    new_age = age == seen_age_ ? (age + 1) % kMaxTTAge : age;
+    return std::pair(new_age, generation);
+  });
+  seen_age_ = new_age;
+}
+
+template <typename Cluster>
+template <typename Function>
+void BasicTranspositionTable<Cluster>::UpdateState(Function &&function) {
+  U64 state = state_->load(std::memory_order_relaxed);
+  U64 new_state;
+  do {
+    const auto [age, generation] = function(static_cast<int>(state & 0xFF),
+                                            static_cast<U16>(state >> 16));
+    new_state = static_cast<U64>(generation) << 16 | static_cast<U64>(age);
+  } while (!state_->compare_exchange_weak(
+      state, new_state, std::memory_order_relaxed));
 }
 
-void TranspositionTable::Age() {
-  age_ = (age_ + 1) % kMaxTTAge;
+template <typename Cluster>
+void BasicTranspositionTable<Cluster>::AttachState() {
+  auto *header = this->GetSharedHeader();
+  state_ = header ? &header->table_state : &private_state_;
+  seen_age_ = GetAge();
 }
 
-int TranspositionTable::HashFull() const {
-  int count = 0;
-  for (int i = 0; i < 1000; i++) {
-    count +=
-        std::ranges::count_if(table_[i].entries, [this](const auto &entry) {
-          return entry.age == age_ && entry.key != 0 &&
-                 entry.score != kScoreNone;
-        });
+template <typename Cluster>
+bool BasicTranspositionTable<Cluster>::HasOtherProcesses() const {
+  const auto *header = this->GetSharedHeader();
+  return header &&
+         header->attached_processes.load(std::memory_order_relaxed) > 1;
+}
+
+template <typename Cluster>
+template <typename Function>
+void BasicTranspositionTable<Cluster>::ForEachSample(
+    std::size_t samples, Function &&function) const {
+  if (samples == 0 || samples > table_size_) {
+    samples = table_size_;
+  }
+
+  // Sample the middle of each stride so that the first and last clusters
+  // aren't over-represented
+  const double stride = static_cast<double>(table_size_) / samples;
+  for (std::size_t i = 0; i < samples; i++) {
+    function(table_[static_cast<std::size_t>((i + 0.5) * stride)]);
   }
-  return count / kTTClusterSize;
 }
 
-void TranspositionTable::Clear(int num_threads) {
+template <typename Cluster>
+int BasicTranspositionTable<Cluster>::HashFull(std::size_t samples) const {
+  const int age = GetAge();
+  const U16 generation = GetGeneration();
+  std::size_t count = 0, total = 0;
+  ForEachSample(samples, [&](const Cluster &cluster) {
+    total += Cluster::kEntryCount;
+    if (cluster.generation != generation) {
+      return;
+    }
+
+    count += std::ranges::count_if(cluster.entries, [age](const auto &entry) {
+      return entry.age == age && entry.key != 0 && entry.score != kScoreNone;
+    });
+  });
+  return static_cast<int>(count * 1000 / std::max<std::size_t>(total, 1));
+}
+
+template <typename Cluster>
+TranspositionTableOccupancy BasicTranspositionTable<Cluster>::GetOccupancy(
+    std::size_t samples) const {
+  TranspositionTableOccupancy occupancy;
+  const U16 generation = GetGeneration();
+  ForEachSample(samples, [&](const Cluster &cluster) {
+    occupancy.clusters++;
+    occupancy.entries += Cluster::kEntryCount;
+    if (cluster.generation != generation) {
+      occupancy.empty += Cluster::kEntryCount;
+      return;
+    }
+
+    for (const auto &entry : cluster.entries) {
+      if (entry.key == 0) {
+        occupancy.empty++;
+        continue;
+      }
+      occupancy.by_age[GetAgeDelta(&entry)]++;
+      occupancy.by_depth[entry.depth]++;
+    }
+  });
+  return occupancy;
+}
+
+template <typename Cluster>
+template <typename Function>
+void BasicTranspositionTable<Cluster>::ForEachChunk(int num_threads,
+                                                    Function &&function) {
+  // Make sure every node gets a slice of the table when placing by first touch
+  if (numa::IsActive()) {
+    num_threads = std::max(num_threads, numa::GetTopology().NodeCount());
+  }
+
   const std::size_t chunks = (table_size_ + num_threads - 1) / num_threads;
 
   std::vector<std::thread> threads;
   for (int i = 0; i < num_threads; ++i) {
-    threads.emplace_back([i, chunks, this]() {
-      const std::size_t clear_index = chunks * i;
-      const std::size_t clear_size =
-          std::min(chunks, table_size_ - clear_index) *
-          sizeof(TranspositionTableCluster);
-      std::memset(table_ + clear_index, 0, clear_size);
+    threads.emplace_back([i, num_threads, chunks, &function, this]() {
+      if (numa::policy == numa::Policy::kBind) {
+        numa::BindCurrentThread(i * numa::GetTopology().NodeCount() /
+                                num_threads);
+      }
+
+      const std::size_t start = chunks * i;
+      function(start, std::min(chunks, table_size_ - start));
     });
   }
 
   for (auto &thread : threads) {
     thread.join();
   }
+}
+
+template <typename Cluster>
+void BasicTranspositionTable<Cluster>::Clear(int num_threads) {
+  PauseSweeper();
+
+  // A newly created segment is already zeroed, and an existing one holds the
+  // entries of the other attached processes along with their age
+  if (this->IsShared()) {
+    return;
+  }
 
-  age_ = 0;
+  ForEachChunk(num_threads, [this](std::size_t start, std::size_t count) {
+    std::memset(table_ + start, 0, count * sizeof(Cluster));
+  });
+
+  private_state_.store(0, std::memory_order_relaxed);
+  seen_age_ = 0;
+  sweep_remaining_ = 0;
 }
 
+template <typename Cluster>
+void BasicTranspositionTable<Cluster>::Free() {
+  PauseSweeper();
+  AlignedHashTable<Cluster>::Free();
+  AttachState();
+  sweep_cursor_ = 0;
+  sweep_remaining_ = 0;
+}
+
+namespace {
+
+constexpr std::array<char, 8> kTTFileMagic = {
+    'I', 'N', 'T', 'G', 'R', 'L', 'T', 'T'};
+constexpr U32 kTTFileVersion = 1;
+
+// Describes the table stored in a hash file, so that it's only ever loaded back
+// into a table with the same layout
+struct TranspositionTableFileHeader {
+  std::array<char, 8> magic;
+  U32 version;
+  U32 entry_bytes;
+  U32 cluster_bytes;
+  U32 cluster_entries;
+  U64 mb_size;
+  U64 cluster_count;
+  U32 age;
+  U32 generation;
+};
+
+// Keeps the sweeper paused for a scope, resuming it on every way out
+template <typename Table>
+class PausedSweeper {
+ public:
+  explicit PausedSweeper(Table &table) : table_(table) {
+    table_.PauseSweeper();
+  }
+
+  ~PausedSweeper() {
+    table_.ResumeSweeper();
+  }
+
+  PausedSweeper(const PausedSweeper &) = delete;
+  PausedSweeper &operator=(const PausedSweeper &) = delete;
+
+ private:
+  Table &table_;
+};
+
+}  // namespace
+
+template <typename Cluster>
+bool BasicTranspositionTable<Cluster>::SaveToFile(const std::string &path,
+                                                  int num_threads) {
+  const PausedSweeper paused(*this);
+
+  const TranspositionTableFileHeader header{
+      .magic = kTTFileMagic,
+      .version = kTTFileVersion,
+      .entry_bytes = sizeof(TranspositionTableEntry),
+      .cluster_bytes = sizeof(Cluster),
+      .cluster_entries = Cluster::kEntryCount,
+      .mb_size = this->GetMbSize(),
+      .cluster_count = table_size_,
+      .age = static_cast<U32>(GetAge()),
+      .generation = GetGeneration(),
+  };
+
+  {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    if (!file) {
+      fmt::println("Error: could not write hash file '{}'", path);
+      return false;
+    }
+  }
+
+  // Size the file up front so that each thread can write its chunk in place
+  std::error_code error;
+  std::filesystem::resize_file(
+      path, sizeof(header) + table_size_ * sizeof(Cluster), error);
+  if (error) {
+    fmt::println("Error: could not resize hash file '{}'", path);
+    return false;
+  }
+
+  std::atomic_bool failed = false;
+  ForEachChunk(num_threads, [&](std::size_t start, std::size_t count) {
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(sizeof(header) + start * sizeof(Cluster));
+    file.write(reinterpret_cast<const char *>(table_ + start),
+               count * sizeof(Cluster));
+    if (!file) failed = true;
+  });
+
+  if (failed) {
+    fmt::println("Error: could not write hash file '{}'", path);
+    return false;
+  }
+
+  return true;
+}
+
+template <typename Cluster>
+bool BasicTranspositionTable<Cluster>::LoadFromFile(const std::string &path,
+                                                    int num_threads) {
+  const PausedSweeper paused(*this);
+
+  if (this->IsShared()) {
+    fmt::println("Error: cannot load a hash file into a shared hash");
+    return false;
+  }
+
+  TranspositionTableFileHeader header{};
+  {
+    std::ifstream file(path, std::ios::binary);
+    file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!file) {
+      fmt::println("Error: could not read hash file '{}'", path);
+      return false;
+    }
+  }
+
+  if (header.magic != kTTFileMagic || header.version != kTTFileVersion) {
+    fmt::println("Error: '{}' is not a hash file", path);
+    return false;
+  }
+
+  if (header.entry_bytes != sizeof(TranspositionTableEntry) ||
+      header.cluster_bytes != sizeof(Cluster) ||
+      header.cluster_entries != Cluster::kEntryCount) {
+    fmt::println(
+        "Error: hash file '{}' has a {}-byte/{}-entry layout, expected {}",
+        path,
+        header.cluster_bytes,
+        header.cluster_entries,
+        kLayoutName);
+    return false;
+  }
+
+  std::error_code error;
+  const auto file_size = std::filesystem::file_size(path, error);
+  if (error ||
+      file_size != sizeof(header) + header.cluster_count * sizeof(Cluster)) {
+    fmt::println("Error: hash file '{}' is truncated", path);
+    return false;
+  }
+
+  // The table must have exactly as many clusters as the saved one, otherwise
+  // the entries would be indexed into the wrong clusters. Resizing here would
+  // leave the table out of sync with the Hash option, so that's left to it
+  if (header.cluster_count != table_size_) {
+    fmt::println(
+        "Error: hash file '{}' was saved with Hash {}, set it before loading",
+        path,
+        header.mb_size);
+    return false;
+  }
+
+  std::atomic_bool failed = false;
+  ForEachChunk(num_threads, [&](std::size_t start, std::size_t count) {
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(sizeof(header) + start * sizeof(Cluster));
+    file.read(reinterpret_cast<char *>(table_ + start),
+              count * sizeof(Cluster));
+    if (!file) failed = true;
+  });
+
+  if (failed) {
+    fmt::println("Error: could not read hash file '{}'", path);
+    Clear(num_threads);
+    return false;
+  }
+
+  UpdateState([&header](int, U16) {
+    return std::pair(static_cast<int>(header.age % kMaxTTAge),
+                     static_cast<U16>(header.generation));
+  });
+  seen_age_ = GetAge();
+
+  // The file may hold clusters of generations older than the saved one
+  sweep_remaining_ = table_size_;
+
+  return true;
+}
+
+template <typename Cluster>
+void BasicTranspositionTable<Cluster>::NewGeneration() {
+  // A new game in one process of a pool mustn't wipe the entries the others
+  // are still searching with
+  if (HasOtherProcesses()) {
+    return;
+  }
+
+  PauseSweeper();
+
+  UpdateState([](int, U16 generation) {
+    return std::pair(0, static_cast<U16>(generation + 1));
+  });
+  seen_age_ = 0;
+
+  // Physically clear stale clusters so that they don't come back to life once
+  // the generation counter wraps around. Every cluster is stale now, so one
+  // full pass from wherever the last sweep stopped reaches all of them
+  sweep_remaining_ = table_size_;
+  ResumeSweeper();
+}
+
+template <typename Cluster>
+void BasicTranspositionTable<Cluster>::PauseSweeper() {
+  std::lock_guard lock(sweeper_mutex_);
+  if (sweeper_.joinable()) {
+    stop_sweeper_.store(true, std::memory_order_relaxed);
+    sweeper_.join();
+  }
+}
+
+template <typename Cluster>
+void BasicTranspositionTable<Cluster>::ResumeSweeper() {
+  std::lock_guard lock(sweeper_mutex_);
+  if (sweeper_.joinable() || sweep_remaining_ == 0) {
+    return;
+  }
+
+  // The cursor is only touched by the sweeper until it is joined again
+  stop_sweeper_.store(false, std::memory_order_relaxed);
+  sweeper_ = std::thread([this]() {
+    constexpr std::size_t kSweepChunk = 1 << 16;
+    while (sweep_remaining_ > 0 &&
+           !stop_sweeper_.load(std::memory_order_relaxed)) {
+      const std::size_t count = std::min(
+          {kSweepChunk, sweep_remaining_, table_size_ - sweep_cursor_});
+      // Other processes may start a new generation of a shared table meanwhile
+      const U16 generation = GetGeneration();
+      for (std::size_t i = sweep_cursor_; i < sweep_cursor_ + count; i++) {
+        auto &cluster = table_[i];
+        if (cluster.generation != generation) {
+          cluster.entries = {};
+          cluster.generation = generation;
+        }
+      }
+
+      sweep_cursor_ = (sweep_cursor_ + count) % table_size_;
+      sweep_remaining_ -= count;
+    }
+  });
+}
+
+template class BasicTranspositionTable<TTCluster32>;
+template class BasicTranspositionTable<TTCluster64>;
+
 }  // namespace search
\ No newline at end of file
@@ -2,14 +2,29 @@
 #define INTEGRAL_TRANSPO_H_
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
 
 #include "../../chess/move.h"
 #include "../../utils/hash_table.h"
 
 namespace search {
 
+// The number of Zobrist key bits stored in each entry to verify hits, chosen at
+// compile time with TT_KEY_BITS. Wider keys make false hits far rarer on huge
+// tables, at the cost of fewer entries per cluster
+#if defined(TT_KEY_BITS) && TT_KEY_BITS == 32
+using TranspositionTableKey = U32;
+#else
+using TranspositionTableKey = U16;
+#endif
+
 struct TranspositionTableEntry {
   enum Flag : U8 {
     kNone,
@@ -35,7 +50,7 @@ struct TranspositionTableEntry {
                                    Score static_eval,
                                    Move move,
                                    bool was_in_pv)
-      : key(static_cast<U16>(key)),
+      : key(static_cast<TranspositionTableKey>(key)),
         depth(depth),
         score(score),
         static_eval(static_eval),
@@ -47,7 +62,7 @@ struct TranspositionTableEntry {
   // Keys are packed to maximize the number of entries the table can hold
   // Therefore, we must down-cast when checking for key equality
   [[nodiscard]] bool CompareKey(const U64 &test_key) const {
-    return static_cast<U16>(test_key) == key;
+    return static_cast<TranspositionTableKey>(test_key) == key;
   }
 
   // Check if the entry's score falls within the search window
@@ -67,7 +82,7 @@ struct TranspositionTableEntry {
     return score;
   }
 
-  U16 key;
+  TranspositionTableKey key;
   I16 score, static_eval;
   Move move;
   U8 depth;
@@ -81,23 +96,118 @@ struct TranspositionTableEntry {
   };
 };
 
-static_assert(sizeof(TranspositionTableEntry) == 10);
+static_assert(sizeof(TranspositionTableEntry) ==
+              8 + sizeof(TranspositionTableKey));
 
-constexpr int kTTClusterSize = 3;
+// Clusters are packed into a power-of-two number of bytes so that a cluster
+// never straddles two cache lines
+template <int entry_count, std::size_t byte_size>
+struct alignas(byte_size) TranspositionTableCluster {
+  static constexpr int kEntryCount = entry_count;
 
-struct TranspositionTableCluster {
-  std::array<TranspositionTableEntry, kTTClusterSize> entries;
-  U16 padding;
+  std::array<TranspositionTableEntry, entry_count> entries;
+  // The table generation this cluster was last written in. Clusters from older
+  // generations are logically empty, which lets the table be cleared in O(1)
+  U16 generation;
 };
 
+// Fits as many entries as possible next to the generation counter
+template <std::size_t byte_size>
+using PackedTTCluster = TranspositionTableCluster<
+    (byte_size - sizeof(U16)) / sizeof(TranspositionTableEntry),
+    byte_size>;
+
+// Two clusters share each cache line
+using TTCluster32 = PackedTTCluster<32>;
+// One cluster fills an entire cache line
+using TTCluster64 = PackedTTCluster<64>;
+
+static_assert(sizeof(TTCluster32) == 32);
+static_assert(sizeof(TTCluster64) == 64);
+
+// Counters used to judge how well the table performs with a given layout and
+// hash size, only gathered in builds with TT_STATS enabled. Each search thread
+// owns one, padded to whole cache lines so that threads never share a line
+struct alignas(64) TranspositionTableStats {
+  U64 probes = 0;
+  U64 hits = 0;
+  // Hits whose move isn't pseudo-legal, so the 16-bit key must have collided
+  U64 collisions = 0;
+  // Searches cut off directly by a TT score
+  U64 cutoffs = 0;
+  U64 saves = 0;
+  // Saves that overwrote the entry, split by why the old entry lost: it was
+  // empty, it belonged to another position, the new search was deep enough, or
+  // it was left over from an earlier search
+  U64 empty_replacements = 0;
+  U64 key_replacements = 0;
+  U64 depth_replacements = 0;
+  U64 age_replacements = 0;
+
+  TranspositionTableStats &operator+=(const TranspositionTableStats &other) {
+    probes += other.probes;
+    hits += other.hits;
+    collisions += other.collisions;
+    cutoffs += other.cutoffs;
+    saves += other.saves;
+    empty_replacements += other.empty_replacements;
+    key_replacements += other.key_replacements;
+    depth_replacements += other.depth_replacements;
+    age_replacements += other.age_replacements;
+    return *this;
+  }
+};
+
+#ifdef TT_STATS
+constexpr bool kTrackTTStats = true;
+#else
+constexpr bool kTrackTTStats = false;
+#endif
+
+// Points at the stats of the search thread that is running on this OS thread,
+// set whenever a search starts
+inline thread_local TranspositionTableStats *tt_stats = nullptr;
+
 constexpr int kMaxTTAge = 32;
 
-class TranspositionTable : public AlignedHashTable<TranspositionTableCluster> {
+// Breakdown of the entries in a sample of the table, used to tune hash sizes
+struct TranspositionTableOccupancy {
+  U64 clusters = 0;
+  U64 entries = 0;
+  // Entries that are empty or belong to a previous generation
+  U64 empty = 0;
+  // Occupied entries by how many searches ago they were written, and by depth
+  std::array<U64, kMaxTTAge> by_age{};
+  std::array<U64, 256> by_depth{};
+};
+
+template <typename Cluster>
+class BasicTranspositionTable : public AlignedHashTable<Cluster> {
  public:
-  explicit TranspositionTable(std::size_t mb_size)
-      : AlignedHashTable(mb_size), age_(0) {}
+  static constexpr std::string_view kLayoutName = [] {
+    if constexpr (sizeof(TranspositionTableKey) == sizeof(U32)) {
+      return sizeof(Cluster) == 64 ? "64-byte/5-entry/32-bit key"
+                                   : "32-byte/2-entry/32-bit key";
+    } else {
+      return sizeof(Cluster) == 64 ? "64-byte/6-entry/16-bit key"
+                                   : "32-byte/3-entry/16-bit key";
+    }
+  }();
+
+  explicit BasicTranspositionTable(std::size_t mb_size)
+      : AlignedHashTable<Cluster>(mb_size) {}
 
-  TranspositionTable() : age_(0) {}
+  BasicTranspositionTable() = default;
+
+  ~BasicTranspositionTable();
+
+  void Resize(std::size_t mb_size);
+
+  // Places the table in the named POSIX shared memory segment on the next
+  // Resize(), so that several processes on one host share the same entries. An
+  // empty name switches back to a private table. Returns whether the name
+  // changed
+  bool SetSharedName(const std::string &name);
 
   [[nodiscard]] TranspositionTableEntry *Probe(const U64 &key);
 
@@ -107,19 +217,107 @@ class TranspositionTable : public AlignedHashTable<TranspositionTableCluster> {
             I32 ply,
             bool in_pv);
 
+  // Advances the age once a search finishes. Shared tables only advance it if
+  // no other process has since this one last aged it, so that it moves once
+  // per move of the whole pool rather than once per attached process
   void Age();
 
-  [[nodiscard]] int HashFull() const;
+  // Estimates the permille of entries written by the current search from
+  // clusters sampled at an even stride across the whole table
+  [[nodiscard]] int HashFull(std::size_t samples) const;
+
+  // Counts the entries of evenly strided clusters by age and depth, scanning
+  // the whole table when samples is zero
+  [[nodiscard]] TranspositionTableOccupancy GetOccupancy(
+      std::size_t samples) const;
 
+  // Shared tables are never cleared since other processes may be using them
   void Clear(int num_threads);
 
+  // Releases the table, so that a shared segment is removed once no other
+  // process is attached to it
+  void Free();
+
+  // Logically clears the table in O(1) by starting a new generation, then
+  // zeroes the stale clusters in the background between searches. Shared
+  // tables are left alone while other processes are attached, as they may be
+  // searching with the entries
+  void NewGeneration();
+
+  // Stops zeroing stale clusters while a search uses the table, since the
+  // sweep would race with its probes and saves
+  void PauseSweeper();
+
+  // Carries on zeroing stale clusters from where the sweep was paused
+  void ResumeSweeper();
+
+  // Streams the table to and from disk in parallel chunks. Loading only
+  // accepts files with the same layout and size as the table
+  bool SaveToFile(const std::string &path, int num_threads);
+
+  bool LoadFromFile(const std::string &path, int num_threads);
+
  private:
+  // Splits the table into contiguous chunks handled by separate threads
+  template <typename Function>
+  void ForEachChunk(int num_threads, Function &&function);
+
   [[nodiscard]] U32 GetAgeDelta(const TranspositionTableEntry *entry) const;
 
+  [[nodiscard]] int GetAge() const {
+    return static_cast<int>(state_->load(std::memory_order_relaxed) & 0xFF);
+  }
+
+  [[nodiscard]] U16 GetGeneration() const {
+    return static_cast<U16>(state_->load(std::memory_order_relaxed) >> 16);
+  }
+
+  // Replaces the age and generation in one step, using the function to compute
+  // them from the current ones in case another process changes them meanwhile
+  template <typename Function>
+  void UpdateState(Function &&function);
+
+  // Points the state at the shared segment's header for shared tables
+  void AttachState();
+
+  // Whether other processes are attached to the same shared table
+  [[nodiscard]] bool HasOtherProcesses() const;
+
+  // Calls the function on each of the evenly strided sampled clusters
+  template <typename Function>
+  void ForEachSample(std::size_t samples, Function &&function) const;
+
  private:
-  int age_;
+  using AlignedHashTable<Cluster>::table_;
+  using AlignedHashTable<Cluster>::table_size_;
+
+  // The age in the low byte and the generation above it, packed into one word
+  // so that both always change together. Shared tables keep it in the header
+  // of their segment, so that every attached process ages the table in step
+  // instead of evicting the others' fresh entries as old
+  std::atomic<U64> private_state_ = 0;
+  std::atomic<U64> *state_ = &private_state_;
+  // The age this process last saw when aging the table
+  int seen_age_ = 0;
+  // Searches resume the sweep from their own thread once they finish, while
+  // the UCI thread pauses it
+  std::mutex sweeper_mutex_;
+  std::thread sweeper_;
+  std::atomic_bool stop_sweeper_;
+  // The sweep walks the table cyclically from the cursor, and a new generation
+  // continues from there instead of restarting, so that short games between
+  // searches still get every cluster zeroed eventually
+  std::size_t sweep_cursor_ = 0;
+  std::size_t sweep_remaining_ = 0;
 };
 
+// The cluster layout is chosen at compile time with TT_CLUSTER_BYTES
+#if defined(TT_CLUSTER_BYTES) && TT_CLUSTER_BYTES == 64
+using TranspositionTable = BasicTranspositionTable<TTCluster64>;
+#else
+using TranspositionTable = BasicTranspositionTable<TTCluster32>;
+#endif
+
 }  // namespace search
 
 #endif  // INTEGRAL_TRANSPO_H_
\ No newline at end of file
@@ -1,11 +1,16 @@
 #include "uci.h"
 
+#include <chrono>
+#include <fstream>
+#include <numeric>
 #include <string>
+#include <utility>
 
 #include "../../ascii_logo.h"
 #include "../../data_gen/data_gen.h"
 #include "../../tests/tests.h"
-#include "../evaluation/nnue/sparse.h"
+#include "../evaluation/nnue/kernels.h"
+#include "../evaluation/nnue/nnue.h"
 #include "../search/search.h"
 #include "../search/syzygy/syzygy.h"
 #include "fmt/format.h"
@@ -19,13 +24,73 @@ void Initialize(search::Searcher &searcher) {
   // clang-format off
   listener.AddOption<OptionVisibility::kPublic>("Hash", 64, 1, 1048576, [&searcher](const Option &option) {
     searcher.ResizeHash(option.GetValue<int>());
+    // Skip the report for the default size that's allocated at startup
+    if (reporter::using_uci) {
+      fmt::println("info string Hash {} MB allocated with {}",
+                   searcher.GetHashMbSize(),
+                   PageKindToString(searcher.GetHashPageKind()));
+    }
+  });
+  listener.AddOption<OptionVisibility::kPublic>("EvalCacheMB", static_cast<I64>(eval::kDefaultEvalCacheMbSize), 1, 4096, [&searcher](const Option &option) {
+    searcher.ResizeEvalCache(option.GetValue<int>());
+  });
+  listener.AddOption<OptionVisibility::kPublic>("EvalCacheShared", false, [&searcher](const Option &option) {
+    searcher.SetSharedEvalCache(option.GetValue<bool>());
   });
   listener.AddOption<OptionVisibility::kPublic>("Threads", 1, 1, 512, [&searcher](const Option &option) {
     searcher.SetThreadCount(option.GetValue<U16>());
   });
+  listener.AddOption<OptionVisibility::kPublic>("NumaPolicy", std::string("none"), [&searcher](const Option &option) {
+    const auto policy = numa::PolicyFromString(option.GetValue<std::string>());
+    if (!policy) {
+      fmt::println("Error: invalid NumaPolicy '{}', expected none, bind or interleave", option.GetValue<std::string>());
+      return;
+    }
+    searcher.SetNumaPolicy(*policy);
+    if (reporter::using_uci) {
+      fmt::println("info string NumaPolicy {} across {} node(s)",
+                   option.GetValue<std::string>(),
+                   numa::GetTopology().NodeCount());
+    }
+  });
+  listener.AddOption<OptionVisibility::kPublic>("SharedHash", std::string("<empty>"), [&searcher](const Option &option) {
+    auto name = option.GetValue<std::string>();
+    if (name == "<empty>") name.clear();
+    if (name.find('/') != std::string::npos) {
+      fmt::println("Error: invalid SharedHash '{}', names can't contain '/'", name);
+      return;
+    }
+    if (!searcher.SetSharedHash(name)) {
+      fmt::println("Error: could not attach to SharedHash '{}', using a private hash", name);
+      return;
+    }
+    if (reporter::using_uci && !name.empty()) {
+      fmt::println("info string SharedHash {} attached ({} MB)", name, searcher.GetHashMbSize());
+    }
+  });
+  listener.AddOption<OptionVisibility::kPublic>("HashFullSamples", 1000, 1, 1 << 24);
   listener.AddOption<OptionVisibility::kPublic>("MultiPV", 1, 1, 6);
   listener.AddOption<OptionVisibility::kPublic>("MoveOverhead", 10, 0, 10000);
   listener.AddOption<OptionVisibility::kPublic>("Minimal", false);
+  listener.AddOption<OptionVisibility::kPublic>("EvalFile", std::string("<internal>"), [&searcher](const Option &option) {
+    const auto path = option.GetValue<std::string>();
+    const bool internal = path == "<internal>" || path.empty();
+    // Nothing to do if the network is already loaded, such as the embedded one
+    // when the option is created
+    if ((internal ? std::string() : path) == nnue::GetLoadedNetworkPath()) {
+      return;
+    }
+
+    if (internal) {
+      nnue::LoadFromIncBin();
+    } else if (!nnue::LoadFromFile(path)) {
+      return;
+    }
+    searcher.NetworkChanged();
+    if (reporter::using_uci) {
+      fmt::println("info string EvalFile {} loaded", path);
+    }
+  });
   listener.AddOption<OptionVisibility::kPublic>("SyzygyPath", std::string("<empty>"), [](const Option &option) {
     syzygy::SetPath(option.GetValue<std::string>());
   });
@@ -39,6 +104,56 @@ void Initialize(search::Searcher &searcher) {
 
 namespace commands {
 
+namespace {
+
+// Positions of FEN files are handled in blocks to bound memory on huge datasets
+constexpr std::size_t kFenBlockSize = 16384;
+
+// Reads a file with one FEN per line, passing each valid position to on_position
+// and calling on_block after every kFenBlockSize of them and at the end. Returns
+// the number of lines that weren't valid positions
+template <typename OnPosition, typename OnBlock>
+U64 ReadFenFile(std::ifstream &input, OnPosition &&on_position, OnBlock &&on_block) {
+  U64 skipped = 0;
+  std::size_t block_size = 0;
+  std::string line;
+  while (std::getline(input, line)) {
+    // Datasets commonly annotate positions after a '|' or ';'
+    auto fen = line.substr(0, line.find_first_of("|;"));
+    fen.erase(fen.find_last_not_of(" \t\r") + 1);
+    if (fen.empty()) continue;
+
+    BoardState state;
+    try {
+      state = fen::StringToBoard(fen);
+    } catch (const std::exception &) {
+      ++skipped;
+      continue;
+    }
+    // Datasets aren't trusted, and the accumulator refresh only has room for
+    // the features of positions that are reachable in a game
+    const BitBoard back_ranks = kRankMasks[kRank1] | kRankMasks[kRank8];
+    if (state.King(Color::kWhite).PopCount() != 1 ||
+        state.King(Color::kBlack).PopCount() != 1 ||
+        state.Occupied(Color::kWhite).PopCount() > 16 ||
+        state.Occupied(Color::kBlack).PopCount() > 16 ||
+        (state.Pawns() & back_ranks)) {
+      ++skipped;
+      continue;
+    }
+
+    on_position(std::move(fen), state);
+    if (++block_size == kFenBlockSize) {
+      on_block();
+      block_size = 0;
+    }
+  }
+  on_block();
+  return skipped;
+}
+
+}  // namespace
+
 void Initialize(Board &board, search::Searcher &searcher) {  // clang-format off
   listener.RegisterCommand("position", CommandType::kOrdered, {
     CreateArgument("fen", ArgumentType::kOptional, LimitedInputProcessor<6>()),
@@ -158,6 +273,160 @@ void Initialize(Board &board, search::Searcher &searcher) {  // clang-format off
     searcher.NewGame();
   });
 
+  listener.RegisterCommand("savehash", CommandType::kUnordered, {
+    CreateArgument("file", ArgumentType::kRequired, LimitedInputProcessor<1>()),
+  }, [&searcher](Command *cmd) {
+    const auto path = *cmd->ParseArgument<std::string>("file");
+    if (searcher.SaveHash(path)) fmt::println("info string Saved hash to {}", path);
+  });
+
+  listener.RegisterCommand("loadhash", CommandType::kUnordered, {
+    CreateArgument("file", ArgumentType::kRequired, LimitedInputProcessor<1>()),
+  }, [&searcher](Command *cmd) {
+    const auto path = *cmd->ParseArgument<std::string>("file");
+    if (searcher.LoadHash(path)) {
+      fmt::println("info string Loaded hash from {} ({} MB)", path, searcher.GetHashMbSize());
+    }
+  });
+
+  listener.RegisterCommand("ttstats", CommandType::kUnordered, {}, [&searcher](Command *cmd) {
+    if (!search::kTrackTTStats) {
+      fmt::println("Error: ttstats requires a build with TT_STATS=ON");
+      return;
+    }
+
+    const auto stats = searcher.GetTTStats();
+    const auto percent = [](U64 count, U64 total) {
+      return 100.0 * count / std::max<U64>(total, 1);
+    };
+    fmt::println("info string ttstats probes {} hits {} ({:.2f}%) collisions {} ({:.4f}% of hits) cutoffs {} ({:.2f}% of probes)",
+                 stats.probes, stats.hits, percent(stats.hits, stats.probes),
+                 stats.collisions, percent(stats.collisions, stats.hits),
+                 stats.cutoffs, percent(stats.cutoffs, stats.probes));
+    fmt::println("info string ttstats saves {} replaced empty {} key {} depth {} age {}",
+                 stats.saves, stats.empty_replacements, stats.key_replacements,
+                 stats.depth_replacements, stats.age_replacements);
+  });
+
+  listener.RegisterCommand("evalcachestats", CommandType::kUnordered, {}, [&searcher](Command *cmd) {
+    if (!eval::kTrackEvalCacheStats) {
+      fmt::println("Error: evalcachestats requires a build with EVAL_CACHE_STATS=ON");
+      return;
+    }
+
+    const auto stats = searcher.GetEvalCacheStats();
+    fmt::println("info string evalcachestats probes {} hits {} ({:.2f}%) misses {}",
+                 stats.probes, stats.hits, 100.0 * stats.hits / std::max<U64>(stats.probes, 1),
+                 stats.probes - stats.hits);
+  });
+
+  listener.RegisterCommand("hashstats", CommandType::kUnordered, {
+    CreateArgument("samples", ArgumentType::kOptional, LimitedInputProcessor<1>()),
+  }, [&searcher](Command *cmd) {
+    // Scan the whole table unless told otherwise, since this is only used offline
+    const auto samples = cmd->ParseArgument<int>("samples").value_or(0);
+    const auto occupancy = searcher.GetHashOccupancy(std::max(samples, 0));
+    const auto percent = [&occupancy](U64 count) {
+      return 100.0 * count / std::max<U64>(occupancy.entries, 1);
+    };
+
+    fmt::println("info string hashstats clusters {} entries {} empty {} ({:.2f}%)",
+                 occupancy.clusters, occupancy.entries, occupancy.empty, percent(occupancy.empty));
+    for (int age = 0; age < search::kMaxTTAge; age++) {
+      if (occupancy.by_age[age] == 0) continue;
+      fmt::println("info string hashstats age {} entries {} ({:.2f}%)",
+                   age, occupancy.by_age[age], percent(occupancy.by_age[age]));
+    }
+    for (std::size_t depth = 0; depth < occupancy.by_depth.size(); depth++) {
+      if (occupancy.by_depth[depth] == 0) continue;
+      fmt::println("info string hashstats depth {} entries {} ({:.2f}%)",
+                   depth, occupancy.by_depth[depth], percent(occupancy.by_depth[depth]));
+    }
+  });
+
+  listener.RegisterCommand("evalfens", CommandType::kUnordered, {
+    CreateArgument("file", ArgumentType::kRequired, LimitedInputProcessor<1>()),
+    CreateArgument("out", ArgumentType::kOptional, LimitedInputProcessor<1>()),
+  }, [](Command *cmd) {
+    const auto input_path = *cmd->ParseArgument<std::string>("file");
+    std::ifstream input(input_path);
+    if (!input) {
+      fmt::println("Error: could not open FEN file '{}'", input_path);
+      return;
+    }
+
+    const auto output_path = cmd->ParseArgument<std::string>("out");
+    std::ofstream output_file;
+    if (output_path) {
+      output_file.open(*output_path);
+      if (!output_file) {
+        fmt::println("Error: could not open output file '{}'", *output_path);
+        return;
+      }
+    }
+
+    std::vector<std::string> fens;
+    std::vector<BoardState> states;
+    U64 evaluated = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    const auto skipped = ReadFenFile(input, [&](std::string &&fen, const BoardState &state) {
+      fens.push_back(std::move(fen));
+      states.push_back(state);
+    }, [&] {
+      const auto scores = nnue::EvaluateBatch(states);
+      std::string lines;
+      for (std::size_t i = 0; i < scores.size(); i++) {
+        lines += fmt::format("{} | {}\n", fens[i], scores[i]);
+      }
+      if (output_path) output_file << lines;
+      else fmt::print("{}", lines);
+
+      evaluated += scores.size();
+      fens.clear();
+      states.clear();
+    });
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    fmt::println("info string evalfens {} positions in {} ms ({} positions/s), {} skipped",
+                 evaluated, elapsed, evaluated * 1000 / std::max<I64>(elapsed, 1), skipped);
+  });
+
+  listener.RegisterCommand("activations", CommandType::kUnordered, {
+    CreateArgument("file", ArgumentType::kRequired, LimitedInputProcessor<1>()),
+    CreateArgument("out", ArgumentType::kRequired, LimitedInputProcessor<1>()),
+  }, [](Command *cmd) {
+    const auto input_path = *cmd->ParseArgument<std::string>("file");
+    std::ifstream input(input_path);
+    if (!input) {
+      fmt::println("Error: could not open FEN file '{}'", input_path);
+      return;
+    }
+
+    auto stats = std::make_unique<nnue::ActivationStats<nnue::MainArch>>();
+    std::vector<BoardState> states;
+    const auto skipped = ReadFenFile(input, [&](std::string &&, const BoardState &state) {
+      states.push_back(state);
+    }, [&] {
+      nnue::CountActivations(states, *stats);
+      states.clear();
+    });
+
+    const auto output_path = *cmd->ParseArgument<std::string>("out");
+    std::ofstream output_file(output_path, std::ios::binary);
+    output_file.write(reinterpret_cast<const char *>(stats.get()), sizeof(*stats));
+    if (!output_file) {
+      fmt::println("Error: could not write activation statistics to '{}'", output_path);
+      return;
+    }
+
+    const auto total = stats->position_count * 2 * stats->counts.size();
+    const auto active = std::accumulate(stats->counts.begin(), stats->counts.end(), U64{0});
+    fmt::println("info string activations {} positions, {:.2f}% of neuron pairs active, {} skipped",
+                 stats->position_count, 100.0 * active / std::max<U64>(total, 1), skipped);
+  });
+
   listener.RegisterCommand("eval", CommandType::kUnordered, {}, [&board](Command *cmd) {
     const auto eval = eval::Evaluate(board);
     fmt::println("info cp {}\ninfo normalized cp {}", eval, eval::NormalizeScore(eval, board.GetState().MaterialCount()));
@@ -190,21 +459,31 @@ void Initialize(Board &board, search::Searcher &searcher) {  // clang-format off
   });
 
   listener.RegisterCommand("bench", CommandType::kUnordered, {
-    CreateArgument("depth", ArgumentType::kOptional, NoInputProcessor()),
-  }, [](Command *cmd) {
-    const auto bench_depth = cmd->ParseArgument<int>("depth");
-    if (bench_depth) tests::BenchSuite(*bench_depth);
-    else tests::BenchSuite(tests::kDefaultBenchDepth);
-  });
-
-#ifdef SPARSE_PERMUTE
-  listener.RegisterCommand("permute", CommandType::kUnordered, {
-    CreateArgument("out", ArgumentType::kRequired, LimitedInputProcessor<1>()),
+    CreateArgument("depth", ArgumentType::kOptional, LimitedInputProcessor<1>()),
+    CreateArgument("tt", ArgumentType::kOptional, NoInputProcessor()),
+    CreateArgument("prefetch", ArgumentType::kOptional, NoInputProcessor()),
+    CreateArgument("nnuetail", ArgumentType::kOptional, NoInputProcessor()),
+    CreateArgument("nnz", ArgumentType::kOptional, NoInputProcessor()),
+    CreateArgument("features", ArgumentType::kOptional, NoInputProcessor()),
+    CreateArgument("hash", ArgumentType::kOptional, LimitedInputProcessor<1>()),
   }, [](Command *cmd) {
-    tests::BenchSuite(tests::kDefaultBenchDepth);
-    nnue::sparse::SavePermutedNetwork(*cmd->ParseArgument<std::string>("out"));
+    const auto bench_depth = cmd->ParseArgument<int>("depth").value_or(tests::kDefaultBenchDepth);
+    if (cmd->ArgumentExists("tt")) {
+      const auto hash_size = cmd->ParseArgument<int>("hash");
+      tests::TTBenchSuite(bench_depth, hash_size ? std::vector{*hash_size} : std::vector{16, 64, 256, 1024});
+    } else if (cmd->ArgumentExists("prefetch")) {
+      const auto hash_size = cmd->ParseArgument<int>("hash");
+      tests::PrefetchBenchSuite(bench_depth, hash_size ? std::vector{16, *hash_size} : std::vector{16, 65536});
+    } else if (cmd->ArgumentExists("nnuetail")) {
+      tests::EvalTailBenchSuite();
+    } else if (cmd->ArgumentExists("nnz")) {
+      tests::NnzBenchSuite();
+    } else if (cmd->ArgumentExists("features")) {
+      tests::FeatureWeightBenchSuite(bench_depth);
+    } else {
+      tests::BenchSuite(bench_depth);
+    }
   });
-#endif
 
   listener.RegisterCommand("uci", CommandType::kUnordered, {}, [](Command *cmd) {
     fmt::println(
@@ -222,7 +501,8 @@ void Initialize(Board &board, search::Searcher &searcher) {  // clang-format off
     fmt::println("readyok");
   });
 
-  listener.RegisterCommand("quit", CommandType::kUnordered, {}, [](Command *cmd) {
+  listener.RegisterCommand("quit", CommandType::kUnordered, {}, [&searcher](Command *cmd) {
+    searcher.FreeHash();
     exit(EXIT_SUCCESS);
   });
   // clang-format on
@@ -253,9 +533,26 @@ void AcceptCommands(int arg_count, char **args) {
     return;
   }
 
+  // Offline tools can evaluate FEN files without going through UCI
+  if (args[1] && (std::string(args[1]) == "evalfens" ||
+                  std::string(args[1]) == "activations")) {
+    std::string line;
+    for (int i = 1; i < arg_count; i++) {
+      line += fmt::format("{} ", args[i]);
+    }
+    listener.ExecuteLine(line);
+    return;
+  }
+
   PrintAsciiLogo();
+#ifdef BUILD_FAT
+  fmt::println("    {} by {}", constants::kEngineName, constants::kEngineAuthor);
+  fmt::println("    Using the {} NNUE kernels\n",
+               nnue::kernels::Selected<nnue::MainArch>().name);
+#else
   fmt::println(
       "    {} by {}\n", constants::kEngineName, constants::kEngineAuthor);
+#endif
 
   listener.Listen();
 }
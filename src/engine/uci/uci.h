@@ -27,18 +27,22 @@ class Listener {
   void Listen() {
     std::string line;
     while (std::getline(std::cin, line)) {
-      std::stringstream ss(line);
-      std::string command_name;
-      ss >> command_name;
-
-      auto it = commands_.find(command_name);
-      if (it != commands_.end()) {
-        auto &command = it->second;
-        command->ProcessLine(ss);
-        command->Execute();
-      } else {
-        fmt::println("Error: unknown command: '{}'", command_name);
-      }
+      ExecuteLine(line);
+    }
+  }
+
+  void ExecuteLine(const std::string &line) {
+    std::stringstream ss(line);
+    std::string command_name;
+    ss >> command_name;
+
+    auto it = commands_.find(command_name);
+    if (it != commands_.end()) {
+      auto &command = it->second;
+      command->ProcessLine(ss);
+      command->Execute();
+    } else {
+      fmt::println("Error: unknown command: '{}'", command_name);
     }
   }
 
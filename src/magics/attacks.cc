@@ -121,10 +121,38 @@ BitBoard GenerateRookMoves(Square square, const BitBoard& occupied) {
          SlidingAttacks<Direction::kWest>(square, occupied);
 }
 
+#ifdef BUILD_FAT
+namespace {
+
+// Fat builds only find out at runtime whether the CPU has a fast PEXT, which
+// AMD implements in microcode before Zen 3. Must be initialized before the
+// attack tables below, as it decides how they are indexed
+bool HasFastPext() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("bmi2") && !__builtin_cpu_is("znver1") &&
+         !__builtin_cpu_is("znver2");
+}
+
+const bool use_pext = HasFastPext();
+
+// Emitted without BMI2 being enabled for the whole build, as it only runs
+// when use_pext is set
+inline U64 Pext(U64 value, U64 mask) {
+  U64 result;
+  asm("pextq %2, %1, %0" : "=r"(result) : "r"(value), "r"(mask));
+  return result;
+}
+
+}  // namespace
+#endif
+
 U64 GetBishopAttackIndex(Square square, const BitBoard& occupied) {
 #ifdef USE_PEXT
   return _pext_u64(occupied.AsU64(), kBishopMagics[square].mask);
 #else
+#ifdef BUILD_FAT
+  if (use_pext) return Pext(occupied.AsU64(), kBishopMagics[square].mask);
+#endif
   const auto& entry = kBishopMagics[square];
   return ((occupied.AsU64() & entry.mask) * entry.magic) >> entry.shift;
 #endif
@@ -134,6 +162,9 @@ U64 GetRookAttackIndex(Square square, const BitBoard& occupied) {
 #ifdef USE_PEXT
   return _pext_u64(occupied.AsU64(), kRookMagics[square].mask);
 #else
+#ifdef BUILD_FAT
+  if (use_pext) return Pext(occupied.AsU64(), kRookMagics[square].mask);
+#endif
   const auto& entry = kRookMagics[square];
   return ((occupied.AsU64() & entry.mask) * entry.magic) >> entry.shift;
 #endif
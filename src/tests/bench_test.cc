@@ -1,8 +1,20 @@
 #include "../chess/board.h"
 #include "../chess/move_gen.h"
+#include "../engine/evaluation/nnue/nnue.h"
+#include "../engine/evaluation/nnue/sparse.h"
+#include "../engine/search/move_picker.h"
 #include "../engine/search/search.h"
 #include "tests.h"
 
+#include <random>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace tests {
 
 // clang-format off
@@ -60,25 +72,341 @@ constexpr std::array kBenchFens = {
 };
 // clang-format on
 
-void BenchSuite(int depth) {
-  Board board;
-  search::Searcher searcher(board);
-  searcher.ResizeHash(16);
+struct BenchResult {
+  U64 nodes = 0;
+  U64 elapsed = 0;
+  search::TranspositionTableStats tt_stats;
+
+  [[nodiscard]] U64 Nps() const {
+    return nodes * 1000 / std::max<U64>(elapsed, 1);
+  }
+};
 
+// Counts a hardware event for the calling thread while it's alive, reporting
+// nothing if the kernel or CPU doesn't expose the event
+class PerfCounter {
+ public:
+  explicit PerfCounter(U64 config) {
+#if defined(__linux__)
+    perf_event_attr attributes{};
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.size = sizeof(attributes);
+    attributes.config = config;
+    attributes.disabled = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    fd_ = static_cast<int>(
+        syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+    if (fd_ >= 0) {
+      ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  ~PerfCounter() {
+#if defined(__linux__)
+    if (fd_ >= 0) close(fd_);
+#endif
+  }
+
+  [[nodiscard]] std::string Read() const {
+#if defined(__linux__)
+    U64 count = 0;
+    if (fd_ >= 0 && read(fd_, &count, sizeof(count)) == sizeof(count)) {
+      return std::to_string(count);
+    }
+#endif
+    return "n/a";
+  }
+
+ private:
+  int fd_ = -1;
+};
+
+BenchResult RunBench(Board &board, search::Searcher &searcher, int depth) {
   auto bench_thread = std::make_unique<search::Thread>(0);
 
-  U64 nodes = 0, elapsed = 0;
+  BenchResult result;
   for (const auto &position : kBenchFens) {
     board.SetFromFen(position);
     searcher.NewGame(false);
 
-    nodes += searcher.Bench(bench_thread, depth);
-    elapsed += searcher.GetTimeManagement().TimeElapsed();
+    result.nodes += searcher.Bench(bench_thread, depth);
+    result.elapsed += searcher.GetTimeManagement().TimeElapsed();
+  }
+
+  result.tt_stats = bench_thread->tt_stats;
+  return result;
+}
+
+void BenchSuite(int depth) {
+  Board board;
+  search::Searcher searcher(board);
+  searcher.ResizeHash(16);
+
+  const auto result = RunBench(board, searcher, depth);
+  fmt::println("{} nodes {} nps", result.nodes, result.Nps());
+}
+
+void TTBenchSuite(int depth, const std::vector<int> &hash_sizes) {
+  fmt::println("TT layout {}", search::TranspositionTable::kLayoutName);
+  if (!search::kTrackTTStats) {
+    fmt::println("Build with TT_STATS=ON to measure hit rate and churn");
+  }
+
+  for (const int hash_size : hash_sizes) {
+    Board board;
+    search::Searcher searcher(board);
+    searcher.ResizeHash(hash_size);
+
+    const auto result = RunBench(board, searcher, depth);
+    const auto &stats = result.tt_stats;
+
+    std::string line = fmt::format("hash {:>6} MB | {:>10} nodes | {:>9} nps",
+                                   hash_size,
+                                   result.nodes,
+                                   result.Nps());
+    if (search::kTrackTTStats) {
+      line += fmt::format(
+          " | hit rate {:5.2f}% | churn {:5.2f}% | collisions {}",
+          100.0 * stats.hits / std::max<U64>(stats.probes, 1),
+          100.0 * stats.key_replacements / std::max<U64>(stats.saves, 1),
+          stats.collisions);
+    }
+    fmt::println("{}", line);
+  }
+}
+
+void PrefetchBenchSuite(int depth, const std::vector<int> &hash_sizes) {
+  const int default_distance = search::tt_prefetch_distance;
+
+  for (const int hash_size : hash_sizes) {
+    for (const int distance : {0, default_distance}) {
+      search::tt_prefetch_distance = distance;
+
+      Board board;
+      search::Searcher searcher(board);
+      try {
+        searcher.ResizeHash(hash_size);
+      } catch (const std::bad_alloc &) {
+        fmt::println("Error: could not allocate a {} MB hash", hash_size);
+        break;
+      }
+
+#if defined(__linux__)
+      PerfCounter cycles(PERF_COUNT_HW_CPU_CYCLES);
+      PerfCounter stalls(PERF_COUNT_HW_STALLED_CYCLES_BACKEND);
+#endif
+      const auto result = RunBench(board, searcher, depth);
+
+      fmt::println(
+          "hash {:>6} MB | prefetch {} | {:>10} nodes | {:>9} nps | cycles "
+          "{} | backend stalls {}",
+          hash_size,
+          distance,
+          result.nodes,
+          result.Nps(),
+#if defined(__linux__)
+          cycles.Read(),
+          stalls.Read());
+#else
+          "n/a",
+          "n/a");
+#endif
+    }
+  }
+
+  search::tt_prefetch_distance = default_distance;
+}
+
+void FeatureWeightBenchSuite(int depth) {
+  const auto network = nnue::GetNetwork<nnue::MainArch>();
+  fmt::println("feature weights {} | {:.1f} MB",
+               sizeof(nnue::FeatureWeight) == 1 ? "int8" : "int16",
+               sizeof(network->feature_weights) / (1024.0 * 1024.0));
+
+  Board board;
+  search::Searcher searcher(board);
+  searcher.ResizeHash(16);
+
+#if defined(__linux__)
+  PerfCounter cache_misses(PERF_COUNT_HW_CACHE_MISSES);
+  PerfCounter cache_references(PERF_COUNT_HW_CACHE_REFERENCES);
+#endif
+  const auto result = RunBench(board, searcher, depth);
+
+  fmt::println("{} nodes | {} nps | cache misses {} | cache references {}",
+               result.nodes,
+               result.Nps(),
+#if defined(__linux__)
+               cache_misses.Read(),
+               cache_references.Read());
+#else
+               "n/a",
+               "n/a");
+#endif
+}
+
+void EvalTailBenchSuite() {
+  constexpr int kRepetitions = 200;
+
+  U64 positions = 0, sign_flips = 0;
+  I64 total_error = 0, max_error = 0;
+  std::array<U64, 2> elapsed_ns{};
+
+  const auto evaluate_position = [&](Board &board) {
+    std::array<Score, 2> scores;
+    for (const auto tail : {nnue::OutputTail::kFloat,
+                            nnue::OutputTail::kInteger}) {
+      const auto index = static_cast<int>(tail);
+      scores[index] = nnue::Evaluate(board, tail);
+
+      // The accumulator is up to date after the first call, so only the
+      // forward pass is timed
+      const auto start = std::chrono::steady_clock::now();
+      for (int i = 0; i < kRepetitions; i++) {
+        scores[index] = nnue::Evaluate(board, tail);
+      }
+      elapsed_ns[index] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+    }
+
+    const I64 error = std::abs(scores[0] - scores[1]);
+    total_error += error;
+    max_error = std::max(max_error, error);
+    sign_flips += (scores[0] > 0) != (scores[1] > 0);
+    ++positions;
+  };
+
+  // Evaluate every bench position along with each of its legal children
+  Board board;
+  for (const auto &fen : kBenchFens) {
+    board.SetFromFen(fen);
+    evaluate_position(board);
+
+    auto moves = move_gen::GenerateMoves<MoveGenType::kAll>(board);
+    for (int i = 0; i < moves.Size(); i++) {
+      if (!board.IsMoveLegal(moves[i])) continue;
+
+      board.MakeMove(moves[i]);
+      evaluate_position(board);
+      board.UndoMove();
+    }
   }
 
-  fmt::println("{} nodes {} nps",
-               nodes,
-               static_cast<U64>(nodes * 1000 / std::max<U64>(elapsed, 1)));
+  const auto ns_per_eval = [&](nnue::OutputTail tail) {
+    return static_cast<double>(elapsed_ns[static_cast<int>(tail)]) /
+           (positions * kRepetitions);
+  };
+  fmt::println("{} positions | float {:.1f} ns/eval | integer {:.1f} ns/eval",
+               positions,
+               ns_per_eval(nnue::OutputTail::kFloat),
+               ns_per_eval(nnue::OutputTail::kInteger));
+  fmt::println("integer vs float | mean error {:.2f} | max error {} | sign "
+               "flips {}",
+               static_cast<double>(total_error) / positions,
+               max_error,
+               sign_flips);
+}
+
+void NnzBenchSuite() {
+#if BUILD_HAS_SIMD
+  using Arch = nnue::MainArch;
+  using Activations = std::array<U8, Arch::kL1Size>;
+  using NnzIndices = nnue::sparse::NnzIndices<Arch>;
+  using NnzFinder = int (*)(const Activations &, NnzIndices &);
+  using L1Propagator = void (*)(const nnue::Network<Arch> &,
+                                int,
+                                const Activations &,
+                                const NnzIndices &,
+                                int,
+                                std::array<I32, Arch::kL2Size> &);
+
+  struct Kernel {
+    std::string_view name;
+    NnzFinder find_nnz;
+    L1Propagator propagate;
+  };
+
+  std::vector<Kernel> kernels = {
+      {"table + 4 groups",
+       nnue::sparse::FindNnzTable<Arch>,
+       nnue::sparse::PropagateL1x4<Arch>},
+  };
+#if BUILD_HAS_AVX512VNNI && BUILD_HAS_AVX512VBMI2
+  kernels.push_back({"compress + 8 groups",
+                     nnue::sparse::FindNnzCompress<Arch>,
+                     nnue::sparse::PropagateL1x8<Arch>});
+#endif
+
+  constexpr int kSamples = 256;
+  constexpr int kRepetitions = 2000;
+  const auto network = nnue::GetNetwork<Arch>();
+
+  std::mt19937 generator(0);
+  std::uniform_int_distribution<int> value_distribution(1, 127);
+  std::uniform_int_distribution<int> byte_distribution(0, 3);
+  std::uniform_real_distribution<double> unit_distribution(0.0, 1.0);
+
+  // Densities around what trained networks show, where a group of four
+  // activations is non-zero if any of its elements are
+  for (const double density : {0.1, 0.25, 0.5}) {
+    // The kernels use aligned loads, just like on Evaluate's stack buffer
+    struct alignas(simd::kAlignment) Sample {
+      Activations activations{};
+    };
+
+    std::vector<Sample> samples(kSamples);
+    for (auto &[activations] : samples) {
+      for (int group = 0; group < Arch::kL1Size / 4; group++) {
+        if (unit_distribution(generator) < density) {
+          activations[group * 4 + byte_distribution(generator)] =
+              value_distribution(generator);
+        }
+      }
+    }
+
+    std::vector<std::array<I32, Arch::kL2Size>> reference(kSamples);
+    for (std::size_t k = 0; k < kernels.size(); k++) {
+      const auto &kernel = kernels[k];
+      NnzIndices nnz_indices;
+      bool matches = true;
+
+      const auto start = std::chrono::steady_clock::now();
+      for (int repetition = 0; repetition < kRepetitions; repetition++) {
+        for (int i = 0; i < kSamples; i++) {
+          alignas(simd::kAlignment) std::array<I32, Arch::kL2Size> sums{};
+          const auto &activations = samples[i].activations;
+          const int nnz_count = kernel.find_nnz(activations, nnz_indices);
+          kernel.propagate(*network,
+                           i % Arch::kOutputBucketCount,
+                           activations,
+                           nnz_indices,
+                           nnz_count,
+                           sums);
+
+          if (repetition == 0) {
+            if (k == 0) reference[i] = sums;
+            matches &= sums == reference[i];
+          }
+        }
+      }
+      const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+
+      fmt::println("density {:4.2f} | {:<20} | {:6.1f} ns{}",
+                   density,
+                   kernel.name,
+                   static_cast<double>(elapsed) / (kSamples * kRepetitions),
+                   matches ? "" : " | MISMATCH");
+    }
+  }
+#else
+  fmt::println("Error: the sparse L1 kernels require a SIMD build");
+#endif
 }
 
-}  // namespace tests
\ No newline at end of file
+}  // namespace tests
@@ -19,6 +19,28 @@ constexpr int kDefaultBenchDepth = 12;
 
 void BenchSuite(int depth);
 
+// Runs the bench at each hash size, reporting the hit rate and replacement
+// churn of the compiled transposition table layout alongside NPS
+void TTBenchSuite(int depth, const std::vector<int> &hash_sizes);
+
+// Runs the bench at each hash size with and without the move picker's TT
+// prefetch lookahead, reporting NPS and backend stall cycles where the CPU
+// exposes them
+void PrefetchBenchSuite(int depth, const std::vector<int> &hash_sizes);
+
+// Runs the bench with the compiled feature weight format, reporting the size of
+// the feature weights and the last level cache misses where the CPU exposes
+// them, to compare builds with and without NNUE_I8_FEATURES
+void FeatureWeightBenchSuite(int depth);
+
+// Evaluates the bench positions and their children with the float and the
+// integer output tail, reporting the time per eval and how far they disagree
+void EvalTailBenchSuite();
+
+// Times the compiled NNZ search and sparse L1 kernels against each other on
+// synthetic activations of a few densities
+void NnzBenchSuite();
+
 void SEESuite();
 
 void PerftSuite();
@@ -1,18 +1,31 @@
 #ifndef INTEGRAL_CACHE_H
 #define INTEGRAL_CACHE_H
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include "types.h"
 
 #if defined(__linux__)
+#include <fcntl.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
 #endif
 
 inline void* aligned_alloc_wrapper(size_t alignment, size_t size) {
@@ -47,6 +60,230 @@ inline void aligned_free(void* ptr) {
 #endif
 }
 
+// The kind of pages that back a large allocation, ordered from best to worst
+enum class PageKind {
+  kHuge1G,
+  kHuge2M,
+  kTransparentHuge,
+  kRegular,
+  // A named POSIX shared memory segment that other processes can attach to
+  kShared
+};
+
+inline std::string_view PageKindToString(PageKind kind) {
+  switch (kind) {
+    case PageKind::kHuge1G:
+      return "1G huge pages";
+    case PageKind::kHuge2M:
+      return "2M huge pages";
+    case PageKind::kTransparentHuge:
+      return "transparent huge pages";
+    case PageKind::kShared:
+      return "shared memory";
+    default:
+      return "regular pages";
+  }
+}
+
+struct LargePageAllocation {
+  void* ptr = nullptr;
+  // The size that was actually mapped, which may be rounded up from the request
+  std::size_t size = 0;
+  PageKind kind = PageKind::kRegular;
+  // Shared segments stay open to lock them when detaching, and are removed by
+  // name once the last process detaches
+  int shared_fd = -1;
+  std::string shared_name;
+};
+
+// Placed at the start of every shared memory segment, ahead of the table.
+// Processes lock the segment while they attach and detach, so that the last one
+// to detach knows to remove it instead of leaving it behind in /dev/shm
+struct SharedSegmentHeader {
+  std::atomic<U32> attached_processes;
+  // State of the table that every attached process must agree on, such as the
+  // transposition table's age and generation
+  std::atomic<U64> table_state;
+};
+
+static_assert(std::atomic<U64>::is_always_lock_free,
+              "Atomics in shared memory must not rely on a per-process lock");
+
+// Keeps the table behind the header page aligned
+constexpr std::size_t kSharedHeaderBytes = 4096;
+
+namespace huge_pages {
+
+constexpr std::size_t k2MB = 2ULL * 1024 * 1024;
+constexpr std::size_t k1GB = 1024ULL * 1024 * 1024;
+
+constexpr std::size_t RoundUp(std::size_t size, std::size_t multiple) {
+  return (size + multiple - 1) / multiple * multiple;
+}
+
+#if defined(__linux__)
+// Attempts to map explicitly reserved huge pages from the hugetlbfs pool, which
+// only succeeds if the administrator has reserved enough of them up front
+inline void* TryMapHugeTlb(std::size_t size, int page_size_flag) {
+#ifdef MAP_HUGETLB
+  void* ptr = mmap(nullptr,
+                   size,
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | page_size_flag,
+                   -1,
+                   0);
+  return ptr == MAP_FAILED ? nullptr : ptr;
+#else
+  return nullptr;
+#endif
+}
+
+// Transparent huge pages are only used for madvise()'d regions if the kernel
+// has them set to "always" or "madvise"
+inline bool TransparentHugePagesEnabled() {
+  std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+  std::string mode;
+  return std::getline(file, mode) && mode.find("[never]") == std::string::npos;
+}
+#endif
+
+}  // namespace huge_pages
+
+// Allocates memory for large tables, preferring explicit 1G then 2M huge pages,
+// then transparent huge pages, and finally falling back to regular pages
+inline LargePageAllocation large_page_alloc(std::size_t alignment,
+                                            std::size_t size) {
+  LargePageAllocation allocation;
+
+#if defined(__linux__)
+#if defined(MAP_HUGE_1GB) && defined(MAP_HUGE_2MB)
+  // Don't waste most of a 1G page on a small table
+  if (size >= huge_pages::k1GB) {
+    const auto rounded_size = huge_pages::RoundUp(size, huge_pages::k1GB);
+    if (void* ptr = huge_pages::TryMapHugeTlb(rounded_size, MAP_HUGE_1GB)) {
+      return {ptr, rounded_size, PageKind::kHuge1G};
+    }
+  }
+
+  if (size >= huge_pages::k2MB) {
+    const auto rounded_size = huge_pages::RoundUp(size, huge_pages::k2MB);
+    if (void* ptr = huge_pages::TryMapHugeTlb(rounded_size, MAP_HUGE_2MB)) {
+      return {ptr, rounded_size, PageKind::kHuge2M};
+    }
+  }
+#endif
+
+  // Align to the huge page boundary so that the kernel is able to back the
+  // whole table with transparent huge pages
+  if (size >= huge_pages::k2MB) {
+    alignment = std::max(alignment, huge_pages::k2MB);
+  }
+  size = huge_pages::RoundUp(size, alignment);
+
+  allocation.ptr = std::aligned_alloc(alignment, size);
+  if (!allocation.ptr) throw std::bad_alloc();
+  allocation.size = size;
+
+  if (size >= huge_pages::k2MB &&
+      madvise(allocation.ptr, size, MADV_HUGEPAGE) == 0 &&
+      huge_pages::TransparentHugePagesEnabled()) {
+    allocation.kind = PageKind::kTransparentHuge;
+  }
+#else
+  allocation.ptr = aligned_alloc_wrapper(alignment, size);
+  allocation.size = size;
+#endif
+
+  return allocation;
+}
+
+// Maps the named POSIX shared memory segment, creating it with room for a
+// table of the requested size if it doesn't exist yet. A segment that already
+// exists keeps the size it was created with, so every attached process indexes
+// it identically. Returns an empty allocation on failure
+inline LargePageAllocation shared_memory_alloc(const std::string& name,
+                                               std::size_t size) {
+#if defined(__linux__)
+  // Retry if the last attached process removes the segment while we wait on it
+  for (int attempt = 0; attempt < 10; attempt++) {
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return {};
+
+    struct stat status {};
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &status) != 0) {
+      close(fd);
+      return {};
+    }
+
+    if (status.st_nlink == 0) {
+      close(fd);
+      continue;
+    }
+
+    // Freshly truncated shared memory reads back as zeroes, so the header and
+    // the table start out cleared without touching any of their pages
+    const bool created = status.st_size == 0;
+    std::size_t mapped_size = kSharedHeaderBytes + size;
+    if (created) {
+      if (ftruncate(fd, static_cast<off_t>(mapped_size)) != 0) {
+        shm_unlink(name.c_str());
+        close(fd);
+        return {};
+      }
+    } else {
+      mapped_size = static_cast<std::size_t>(status.st_size);
+    }
+
+    void* ptr =
+        mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+      if (created) shm_unlink(name.c_str());
+      close(fd);
+      return {};
+    }
+
+    static_cast<SharedSegmentHeader*>(ptr)->attached_processes.fetch_add(
+        1, std::memory_order_relaxed);
+    flock(fd, LOCK_UN);
+
+    if (mapped_size >= huge_pages::k2MB) {
+      madvise(ptr, mapped_size, MADV_HUGEPAGE);
+    }
+
+    return {ptr, mapped_size, PageKind::kShared, fd, name};
+  }
+#endif
+  return {};
+}
+
+inline void large_page_free(const LargePageAllocation& allocation) {
+  if (!allocation.ptr) return;
+
+#if defined(__linux__)
+  if (allocation.kind == PageKind::kShared) {
+    flock(allocation.shared_fd, LOCK_EX);
+    auto* header = static_cast<SharedSegmentHeader*>(allocation.ptr);
+    if (header->attached_processes.fetch_sub(1, std::memory_order_relaxed) ==
+        1) {
+      shm_unlink(allocation.shared_name.c_str());
+    }
+    munmap(allocation.ptr, allocation.size);
+    // Closing the last descriptor also releases the lock
+    close(allocation.shared_fd);
+    return;
+  }
+
+  if (allocation.kind == PageKind::kHuge1G ||
+      allocation.kind == PageKind::kHuge2M) {
+    munmap(allocation.ptr, allocation.size);
+    return;
+  }
+  std::free(allocation.ptr);
+#else
+  aligned_free(allocation.ptr);
+#endif
+}
+
 template <typename T>
 class AlignedHashTable {
  public:
@@ -57,31 +294,82 @@ class AlignedHashTable {
   AlignedHashTable() : table_(nullptr), table_size_(0) {}
 
   ~AlignedHashTable() {
-    if (table_) {
-      aligned_free(table_);
-    }
+    large_page_free(allocation_);
   }
 
   void Resize(std::size_t mb_size) {
     assert(mb_size > 0);
 
+    mb_size_ = mb_size;
+
     constexpr std::size_t kBytesInMegabyte = 1024 * 1024;
     mb_size *= kBytesInMegabyte;
 
     std::size_t num_elements = mb_size / sizeof(T);
     std::size_t alignment = sizeof(T);
 
-    const auto new_table = static_cast<T*>(
-        aligned_alloc_wrapper(alignment, num_elements * sizeof(T)));
-
-    if (table_) {
-      aligned_free(table_);
+    // Release the old table first, since huge pages are a limited resource and
+    // both tables may not fit in the reserved pool at the same time
+    Free();
+
+    if (!shared_name_.empty()) {
+      allocation_ = shared_memory_alloc(shared_name_, num_elements * sizeof(T));
+      if (allocation_.ptr) {
+        const std::size_t table_bytes = allocation_.size - kSharedHeaderBytes;
+        num_elements = table_bytes / sizeof(T);
+        mb_size_ = table_bytes / kBytesInMegabyte;
+        table_ = reinterpret_cast<T*>(static_cast<char*>(allocation_.ptr) +
+                                      kSharedHeaderBytes);
+        table_size_ = num_elements;
+        return;
+      }
+
+      // Fall back to a private table, which callers can detect through
+      // IsShared()
+      shared_name_.clear();
     }
 
-    table_ = new_table;
+    allocation_ = large_page_alloc(alignment, num_elements * sizeof(T));
+    table_ = static_cast<T*>(allocation_.ptr);
     table_size_ = num_elements;
   }
 
+  // Releases the table's memory, detaching from its shared memory segment
+  void Free() {
+    large_page_free(allocation_);
+    allocation_ = {};
+    table_ = nullptr;
+    table_size_ = 0;
+  }
+
+  // Sets the name of the POSIX shared memory segment that the next Resize()
+  // attaches to, or an empty name for a private table
+  void SetSharedName(std::string name) {
+    shared_name_ = std::move(name);
+  }
+
+  [[nodiscard]] const std::string& GetSharedName() const {
+    return shared_name_;
+  }
+
+  [[nodiscard]] bool IsShared() const {
+    return allocation_.kind == PageKind::kShared;
+  }
+
+  // The header of the shared memory segment the table lives in, if any
+  [[nodiscard]] SharedSegmentHeader* GetSharedHeader() const {
+    return IsShared() ? static_cast<SharedSegmentHeader*>(allocation_.ptr)
+                      : nullptr;
+  }
+
+  [[nodiscard]] PageKind GetPageKind() const {
+    return allocation_.kind;
+  }
+
+  [[nodiscard]] std::size_t GetMbSize() const {
+    return mb_size_;
+  }
+
   void Clear() {
     std::fill_n(table_, table_size_, T{});
   }
@@ -103,6 +391,11 @@ class AlignedHashTable {
  protected:
   T* table_ = nullptr;
   std::size_t table_size_ = 0;
+
+ private:
+  LargePageAllocation allocation_;
+  std::size_t mb_size_ = 0;
+  std::string shared_name_;
 };
 
 template <typename T>
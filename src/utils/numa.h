@@ -0,0 +1,174 @@
+#ifndef INTEGRAL_NUMA_H
+#define INTEGRAL_NUMA_H
+
+#include <algorithm>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "string.h"
+#include "types.h"
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// NUMA topology detection and thread/memory placement, read directly from
+// sysfs so that we don't need to link against libnuma
+namespace numa {
+
+enum class Policy {
+  // Let the OS schedule threads and place memory however it likes
+  kNone,
+  // Pin search threads to nodes and spread the TT over the nodes in contiguous
+  // slices by touching each slice first from a thread on that node
+  kBind,
+  // Pin search threads to nodes and interleave the TT page-by-page
+  kInterleave
+};
+
+[[nodiscard]] inline std::optional<Policy> PolicyFromString(
+    std::string_view name) {
+  const auto lowercase = ToLowercase(std::string(name));
+  if (lowercase == "none") return Policy::kNone;
+  if (lowercase == "bind") return Policy::kBind;
+  if (lowercase == "interleave") return Policy::kInterleave;
+  return std::nullopt;
+}
+
+// Parses a sysfs CPU/node list such as "0-15,32-47"
+[[nodiscard]] inline std::vector<int> ParseList(std::string_view list) {
+  std::vector<int> result;
+  for (const auto &range : SplitString(RemoveWhitespace(list), ',')) {
+    if (range.empty()) continue;
+
+    const auto dash = range.find('-');
+    const int first = std::stoi(range.substr(0, dash));
+    const int last =
+        dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int i = first; i <= last; i++) result.push_back(i);
+  }
+  return result;
+}
+
+struct Topology {
+  // The CPUs of each node that this process is allowed to run on
+  std::vector<std::vector<int>> node_cpus;
+  // The system-wide ID of each node, used for memory policies
+  std::vector<int> node_ids;
+
+  [[nodiscard]] int NodeCount() const {
+    return std::max<int>(1, node_cpus.size());
+  }
+};
+
+[[nodiscard]] inline Topology DetectTopology() {
+  Topology topology;
+
+#if defined(__linux__)
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return topology;
+
+  std::ifstream online_file("/sys/devices/system/node/online");
+  std::string online;
+  if (!std::getline(online_file, online)) return topology;
+
+  for (const int node : ParseList(online)) {
+    std::ifstream cpu_file(
+        "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string cpu_list;
+    if (!std::getline(cpu_file, cpu_list)) continue;
+
+    std::vector<int> cpus;
+    for (const int cpu : ParseList(cpu_list)) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+    }
+
+    // Memory-only nodes and nodes outside our affinity mask can't run threads
+    if (!cpus.empty()) {
+      topology.node_cpus.push_back(std::move(cpus));
+      topology.node_ids.push_back(node);
+    }
+  }
+#endif
+
+  return topology;
+}
+
+inline const Topology &GetTopology() {
+  static const Topology topology = DetectTopology();
+  return topology;
+}
+
+inline Policy policy = Policy::kNone;
+
+// Whether threads and memory should be explicitly placed on nodes. This is
+// pointless on machines with a single node
+[[nodiscard]] inline bool IsActive() {
+  return policy != Policy::kNone && GetTopology().NodeCount() > 1;
+}
+
+// Spreads threads over the nodes round-robin, returning the node index that
+// the thread with the given ID should run on
+[[nodiscard]] inline int NodeForThread(U32 thread_id) {
+  return static_cast<int>(thread_id % GetTopology().NodeCount());
+}
+
+// Restricts the calling thread to the CPUs of the given node index, returning
+// whether it was bound
+inline bool BindCurrentThread(int node) {
+#if defined(__linux__)
+  if (!IsActive()) return false;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (const int cpu : GetTopology().node_cpus[node]) CPU_SET(cpu, &cpus);
+
+  return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+#else
+  return false;
+#endif
+}
+
+// Sets an interleaving memory policy on a range that hasn't been touched yet,
+// so that its pages get distributed round-robin over every node on first touch
+inline bool InterleavePages(void *ptr, std::size_t size) {
+#if defined(__linux__) && defined(SYS_mbind)
+  if (!IsActive() || policy != Policy::kInterleave) return false;
+
+  constexpr int kMpolInterleave = 3;
+  constexpr std::size_t kBitsPerWord = sizeof(unsigned long) * 8;
+
+  const auto &node_ids = GetTopology().node_ids;
+  const int max_node = *std::ranges::max_element(node_ids);
+
+  std::vector<unsigned long> node_mask(max_node / kBitsPerWord + 1, 0);
+  for (const int node : node_ids) {
+    node_mask[node / kBitsPerWord] |= 1UL << (node % kBitsPerWord);
+  }
+
+  // mbind() requires a page aligned start address
+  const auto page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  const auto address = reinterpret_cast<std::uintptr_t>(ptr);
+  const auto aligned_address = address & ~(page_size - 1);
+
+  return syscall(SYS_mbind,
+                 aligned_address,
+                 size + (address - aligned_address),
+                 kMpolInterleave,
+                 node_mask.data(),
+                 node_mask.size() * kBitsPerWord + 1,
+                 0) == 0;
+#else
+  return false;
+#endif
+}
+
+}  // namespace numa
+
+#endif  // INTEGRAL_NUMA_H